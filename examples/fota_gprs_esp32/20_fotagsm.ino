@@ -4,4 +4,6 @@ void setupFOTAGSM()
   esp32FOTAGSM.checkPORT = esp32FOTAGSM_checkPORT;
   esp32FOTAGSM.checkRESOURCE = esp32FOTAGSM_checkRESOURCE;  
   esp32FOTAGSM.setModem(modem); 
+  // after an update: confirmed by the first manifest check, else rolled back
+  esp32FOTAGSM.beginValidation();
 }
@@ -17,7 +17,7 @@ esp32FOTAGSM esp32FOTAGSM(boardModel, boardCurrentVersion);
 
 // To define link to check update json
 #define esp32FOTAGSM_checkHOST      "example.com"         // TO CHANGE
-#define esp32FOTAGSM_checkPORT      80                    // TO CHANGE, HTTP ONLY
+#define esp32FOTAGSM_checkPORT      80                    // TO CHANGE, 443 WITH esp32FOTAGSMSecureClient
 #define esp32FOTAGSM_checkRESOURCE  "/firmware.json" // TO CHANGE
 
 // ============== GSM ===============
@@ -1,7 +1,7 @@
 /*
    esp32 firmware OTA
    Date: December 2018
-   Purpose: Perform an OTA update from a bin located on a webserver (HTTP Only)
+   Purpose: Perform an OTA update from a bin located on a webserver (HTTP, or HTTPS through esp32FOTAGSMSecureClient)
 */
 
 #include "esp32fotagsm.h"
@@ -9,9 +9,32 @@
 #include <Update.h>
 #include "ArduinoJson.h"
 #include "esp_log.h"
+#include "esp_ota_ops.h"
+#include <Preferences.h>
+#include "esp_heap_caps.h"
+#include <stdarg.h>
+#include "esp_sleep.h"
+#include "driver/uart.h"
 
 #define CLIENT_TIMEOUT_MS (120000)
-#define DOWNLOAD_CHUNK_SIZE (16380)//(8192)
+#define CLIENT_POLL_MS (10)
+#define HEADER_LINE_SIZE (128)
+#define FLASH_SECTOR_SIZE (4096)
+#define MANIFEST_ENTRY_SIZE (1536)
+#define BLOCK_LIST_MAX_SIZE (16384)
+#define MANIFEST_TIMEOUT_MS (5000)
+#define PREFLIGHT_HEAP_RESERVE (16384)
+#define LINK_POLL_MS (5000)
+#define LINK_RECHECK_MS (60000)
+#define IDLE_POLL_MS (1000)
+#define UART_WAKEUP_THRESHOLD (3)
+#define RESUME_NVS_NAMESPACE "fotagsm"
+#define MANIFEST_NVS_NAMESPACE "fotagsm_mf"
+#define MIRROR_NVS_NAMESPACE "fotagsm_mr"
+#define MIRROR_PROBE_TIMEOUT_MS (10000)
+#define MIRROR_FAILOVER_RETRIES (2)
+#define DEFAULT_MAX_RETRIES (10)
+#define ROLLBACK_NVS_NAMESPACE "fotagsm_rb"
 
 esp32FOTAGSM::esp32FOTAGSM(Client &client, 
                             String firwmareType, int firwmareVersion,
@@ -19,16 +42,104 @@ esp32FOTAGSM::esp32FOTAGSM(Client &client,
                             SemaphoreHandle_t networkSemaphore,
                             int ledPin,
                             uint8_t ledOn,
-                            bool chunkedDownload)
+                            bool chunkedDownload,
+                            size_t chunkSize)
                             :
+                            _firwmareType(firwmareType),
+                            _firwmareVersion(firwmareVersion),
+                            _mirrorCount(0),
+                            _mirror(0),
+                            _targetCount(0),
+                            _preflightFunction(NULL),
+                            _healthCheckFunction(NULL),
+                            _validating(false),
+                            _validationTimeoutMs(600000),
+                            _validationTaskHandle(NULL),
+                            _updateVersion(-1),
+                            _rejectedVersion(-1),
+                            _linkQualityFunction(NULL),
+                            _linkMinRssi(-113),
+                            _linkGoodRssi(-113),
+                            _linkMaxPauseMs(600000),
+                            _linkWeak(false),
+                            _sleepMode(SLEEP_NONE),
+                            _sleepMinMs(2000),
+                            _wakeupUart(-1),
+                            _modemSleepFunction(NULL),
+                            _awakeMilliwatts(0),
+                            _sleepMilliwatts(0),
                             _ledPin(ledPin),
                             _ledOn(ledOn),
-                            _chunkedDownload(chunkedDownload)
+                            _chunkedDownload(chunkedDownload),
+                            _otaTaskHandle(NULL),
+                            _completionCallback(NULL),
+                            _state(OTA_IDLE),
+                            _abortRequested(false),
+                            _otaWritten(0),
+                            _otaSize(0),
+                            _maxRetries(DEFAULT_MAX_RETRIES),
+                            _retryDelayMs(5000),
+                            _maxRetryDelayMs(60000),
+                            _waitingTask(NULL),
+                            _polling(false),
+                            _pollStop(false),
+                            _pollIntervalMs(3600000),
+                            _pollMaxBackoffMs(21600000),
+                            _jitterPercent(20),
+                            _randomState(0),
+                            _retryAfterMs(0),
+                            _checkFailed(false),
+                            _pipelineDepth(1),
+                            _writerTaskHandle(NULL),
+                            _freeBuffers(NULL),
+                            _filledBuffers(NULL),
+                            _writerDone(NULL),
+                            _writerWritten(0),
+                            _writerFailed(false),
+                            _poolBufferSize(chunkSize),
+                            _poolCount(0),
+                            _poolUsePSRAM(true),
+                            _userBuffer(NULL),
+                            _userBufferSize(0),
+                            _chunkMin(0),
+                            _chunkGrowAfter(2),
+                            _chunkSize(chunkSize),
+                            _cleanChunks(0),
+                            _resumable(false),
+                            _checkpointInterval(16 * FLASH_SECTOR_SIZE),
+                            _partition(NULL),
+                            _partSize(0),
+                            _flashOffset(0),
+                            _eraseEnd(0),
+                            _stagingPartition(NULL),
+                            _sink(&_updateSink),
+                            _skipHead(false),
+                            _streaming(false),
+                            _imageSize(0),
+                            _blockSize(0),
+                            _publicKey(NULL),
+                            _requestLength(0),
+                            _requestOverflow(false),
+                            _userAgent(firwmareType + "/" + String(firwmareVersion) + " esp32FOTAGSM"),
+                            _keepAlive(false),
+                            _keepAliveIdleMs(10000),
+                            _sessionPort(0),
+                            _sessionKeepAlive(false),
+                            _sessionLastUsed(0),
+                            _manifestUpdate(false),
+                            _manifestCacheLoaded(false),
+                            _networkYieldMs(1),
+                            _lockHeld(false),
+                            _lockTakenAt(0),
+                            _lockStats(),
+                            _metrics(),
+                            _metricsCallback(NULL)
 {
     this->setClient(client);
     this->setConnectionCheckFunction(connectionCheckFunction);
     this->setNetworkSemaphore(networkSemaphore);
     useDeviceID = false;
+    useVersion = false;
 }
 
 bool esp32FOTAGSM::_checkConnection()
@@ -42,672 +153,3546 @@ bool esp32FOTAGSM::_checkConnection()
     }
 }
 
+// Registered and at least the minimum signal, always true without a link
+// quality function
+bool esp32FOTAGSM::_linkUsable(const LinkQuality &link)
+{
+    return link.registered && link.rssi >= _linkMinRssi;
+}
+
+// Before a chunk: pause while the link is unusable rather than failing chunks
+// on it, and use the smallest chunks while the signal is weak. False if the
+// update was aborted or the link did not recover within the maximum pause.
+bool esp32FOTAGSM::_waitForLink(size_t minChunkSize, size_t maxChunkSize)
+{
+    if (_linkQualityFunction == NULL)
+    {
+        return true;
+    }
+
+    unsigned long start = millis();
+    LinkQuality link = _linkQualityFunction();
+    if (!_linkUsable(link))
+    {
+        ESP_LOGW(TAG, "Link unusable (registered %d, %d dBm, technology %d), pausing the download",
+                 link.registered, link.rssi, link.technology);
+        while (!_linkUsable(link))
+        {
+            if (millis() - start > _linkMaxPauseMs)
+            {
+                ESP_LOGE(TAG, "Link did not recover in %lu ms", _linkMaxPauseMs);
+                _metrics.linkWaitMs += millis() - start;
+                return false;
+            }
+            // the modem has to stay awake to find the network again
+            _metrics.sleepMs += _idleWait(LINK_POLL_MS, _abortRequested, false);
+            if (_abortRequested)
+            {
+                _metrics.linkWaitMs += millis() - start;
+                return false;
+            }
+            link = _linkQualityFunction();
+        }
+        _metrics.linkWaitMs += millis() - start;
+        ESP_LOGD(TAG, "Link recovered at %d dBm after %lu ms", link.rssi, millis() - start);
+    }
+
+    bool weak = link.rssi < _linkGoodRssi;
+    if (weak && _chunkSize > minChunkSize)
+    {
+        ESP_LOGD(TAG, "Weak signal (%d dBm), chunks of %u bytes", link.rssi, minChunkSize);
+        _chunkSize = minChunkSize;
+        _cleanChunks = 0;
+    }
+    else if (!weak && _linkWeak)
+    {
+        ESP_LOGD(TAG, "Good signal (%d dBm), chunks of %u bytes", link.rssi, maxChunkSize);
+        _chunkSize = maxChunkSize;
+    }
+    _linkWeak = weak;
+    return true;
+}
+
+// Refuse an update that cannot succeed before any of it is downloaded: the
+// image must fit the OTA (and staging) partition and each target its sink, the
+// download buffers, decoders and sinks must fit in RAM and the application
+// must agree
+bool esp32FOTAGSM::_preflight()
+{
+    // another sink checks its own space in fits() and begin()
+    if (_sink != &_updateSink && _imageSize > 0 && !_sink->fits(_imageSize))
+    {
+        ESP_LOGE(TAG, "Preflight: the image of %u bytes does not fit the sink", _imageSize);
+        return false;
+    }
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL && _sink == &_updateSink)
+    {
+        ESP_LOGE(TAG, "Preflight: no OTA partition");
+        return false;
+    }
+    if (partition != NULL && _sink == &_updateSink && _imageSize > partition->size)
+    {
+        ESP_LOGE(TAG, "Preflight: the image of %u bytes does not fit %s (%u bytes)", _imageSize, partition->label, partition->size);
+        return false;
+    }
+    // an encoded download is staged as it arrives, its size is not known yet
+    bool encoded = _deltaBin.length() > 0 || _compression.length() > 0;
+    if (_stagingPartition != NULL && !encoded && _imageSize > _stagingPartition->size)
+    {
+        ESP_LOGE(TAG, "Preflight: the image of %u bytes does not fit %s (%u bytes)", _imageSize, _stagingPartition->label, _stagingPartition->size);
+        return false;
+    }
+
+    // the targets are downloaded through the first pool buffer, counted below,
+    // but their sinks keep what they allocate until the application image is done
+    size_t needed = _sink->memoryNeeded();
+    for (uint8_t i = 0; i < _targetCount; i++)
+    {
+        const Target &target = _targets[i];
+        if (target.bin.length() == 0)
+        {
+            continue;
+        }
+        if (target.size > 0 && !target.sink->fits(target.size))
+        {
+            ESP_LOGE(TAG, "Preflight: target %s of %u bytes does not fit its sink", target.name.c_str(), target.size);
+            return false;
+        }
+        needed += target.sink->memoryNeeded();
+    }
+
+    if (_userBuffer == NULL)
+    {
+        needed += _poolBufferSize * (_pipelineDepth > 1 ? _pipelineDepth : 1);
+    }
+    if (_compression.length() > 0 || _deltaCompression.length() > 0)
+    {
+        needed += esp32FOTAGSMInflater::memoryNeeded();
+    }
+    if (_deltaBin.length() > 0)
+    {
+        needed += DELTA_BUFFER_SIZE;
+    }
+    if (_blocksPath.length() > 0)
+    {
+        needed += BLOCK_LIST_MAX_SIZE;
+    }
+
+    uint32_t caps = _poolUsePSRAM && psramFound() ? MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+    size_t freeHeap = heap_caps_get_free_size(caps);
+    if (freeHeap < needed + PREFLIGHT_HEAP_RESERVE ||
+        (_userBuffer == NULL && heap_caps_get_largest_free_block(caps) < _poolBufferSize))
+    {
+        ESP_LOGE(TAG, "Preflight: %u bytes of RAM needed, %u free", needed + PREFLIGHT_HEAP_RESERVE, freeHeap);
+        return false;
+    }
+
+    if (_preflightFunction != NULL && !_preflightFunction(_imageSize))
+    {
+        ESP_LOGE(TAG, "Preflight: refused by the application");
+        return false;
+    }
+    return true;
+}
+
 void esp32FOTAGSM::_blockingNetworkSemaphoreTake()
 {
     if (_networkSemaphore != NULL)
     {
-        ESP_LOGD(TAG, "Taking network semaphore (blocking)");
-        xSemaphoreTake(_networkSemaphore, portMAX_DELAY);
-    }else{
-        ESP_LOGD(TAG, "No network semaphore");
+        ESP_LOGD(TAG, "Taking network semaphore (blocking)");
+        unsigned long start = millis();
+        xSemaphoreTake(_networkSemaphore, portMAX_DELAY);
+        _lockTakenAt = millis();
+        _lockHeld = true;
+
+        uint32_t waited = _lockTakenAt - start;
+        _metrics.networkWaitMs += waited;
+        _lockStats.takes++;
+        _lockStats.waitTotalMs += waited;
+        if (waited > _lockStats.waitMaxMs)
+        {
+            _lockStats.waitMaxMs = waited;
+        }
+    }else{
+        ESP_LOGD(TAG, "No network semaphore");
+    }
+}
+
+void esp32FOTAGSM::_blockingNetworkSemaphoreGive()
+{
+    if (_networkSemaphore != NULL)
+    {
+        // giving a semaphore we do not hold would hand the modem to a second task
+        if (!_lockHeld)
+        {
+            ESP_LOGW(TAG, "Network semaphore given but not held");
+            return;
+        }
+        ESP_LOGD(TAG, "Giving network semaphore");
+
+        uint32_t held = millis() - _lockTakenAt;
+        _lockStats.holdTotalMs += held;
+        if (held > _lockStats.holdMaxMs)
+        {
+            _lockStats.holdMaxMs = held;
+        }
+        _lockHeld = false;
+        xSemaphoreGive(_networkSemaphore);
+    }else{
+        ESP_LOGD(TAG, "No network semaphore");
+    }
+}
+
+// Between chunks, let a task waiting for the network semaphore take it.
+// With nobody waiting this costs a single tick.
+void esp32FOTAGSM::_networkYield()
+{
+    if (_networkSemaphore == NULL)
+    {
+        return;
+    }
+    if (_networkYieldMs == 0)
+    {
+        taskYIELD();
+    }
+    else
+    {
+        vTaskDelay(pdMS_TO_TICKS(_networkYieldMs));
+    }
+}
+
+// Wait until the client has data to read, the server closed the connection or
+// timeoutMs elapsed. Between polls the task sleeps on its notification, so the
+// modem driver and lower priority tasks keep running. notifyDataAvailable() wakes
+// it early, e.g. from a UART event handler.
+bool esp32FOTAGSM::_waitForData(unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+
+    _waitingTask = xTaskGetCurrentTaskHandle();
+    while (_client->available() == 0)
+    {
+        // nothing more comes once the server has closed the connection
+        if (!_client->connected() || millis() - start > timeoutMs)
+        {
+            _waitingTask = NULL;
+            return false;
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CLIENT_POLL_MS));
+    }
+    _waitingTask = NULL;
+    return true;
+}
+
+// Wait for the response to the request just sent, counting the time to its
+// first byte
+bool esp32FOTAGSM::_waitForResponse()
+{
+    unsigned long start = millis();
+    bool received = _waitForData(CLIENT_TIMEOUT_MS);
+    uint32_t waited = millis() - start;
+
+    _metrics.requests++;
+    if (!received)
+    {
+        _metrics.timeouts++;
+        return false;
+    }
+    _metrics.ttfbTotalMs += waited;
+    if (waited > _metrics.ttfbMaxMs)
+    {
+        _metrics.ttfbMaxMs = waited;
+    }
+    return true;
+}
+
+// Wake a task waiting for response data, e.g. from the modem UART event handler
+void esp32FOTAGSM::notifyDataAvailable()
+{
+    TaskHandle_t task = _waitingTask;
+    if (task != NULL)
+    {
+        xTaskNotifyGive(task);
+    }
+}
+
+void esp32FOTAGSM::notifyDataAvailableFromISR()
+{
+    TaskHandle_t task = _waitingTask;
+    if (task != NULL)
+    {
+        BaseType_t higherPriorityTaskWoken = pdFALSE;
+        vTaskNotifyGiveFromISR(task, &higherPriorityTaskWoken);
+        portYIELD_FROM_ISR(higherPriorityTaskWoken);
+    }
+}
+
+// Get count chunk buffers of _poolBufferSize bytes, either slices of the buffer
+// given to setChunkBuffer() or fresh allocations (PSRAM first when enabled).
+// Returns the number of buffers available, which may be less than count.
+uint8_t esp32FOTAGSM::_poolAcquire(uint8_t count)
+{
+    _poolRelease();
+
+    if (_userBuffer != NULL)
+    {
+        // at least 1 KB per slice, otherwise use fewer buffers
+        while (count > 1 && _userBufferSize / count < 1024)
+        {
+            count--;
+        }
+        _poolBufferSize = _userBufferSize / count;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            _poolBuffers[i] = _userBuffer + i * _poolBufferSize;
+        }
+        _poolCount = count;
+        return _poolCount;
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t *buffer = NULL;
+        if (_poolUsePSRAM && psramFound())
+        {
+            buffer = (uint8_t *)heap_caps_malloc(_poolBufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        }
+        if (buffer == NULL)
+        {
+            buffer = (uint8_t *)malloc(_poolBufferSize);
+        }
+        if (buffer == NULL)
+        {
+            ESP_LOGW(TAG, "Only %u of %u download buffers could be allocated", i, count);
+            break;
+        }
+        _poolBuffers[_poolCount++] = buffer;
+    }
+    return _poolCount;
+}
+
+// Give the chunk buffers back, so the steady state RAM budget does not pay for OTA
+void esp32FOTAGSM::_poolRelease()
+{
+    for (uint8_t i = 0; i < _poolCount; i++)
+    {
+        if (_userBuffer == NULL)
+        {
+            free(_poolBuffers[i]);
+        }
+        _poolBuffers[i] = NULL;
+    }
+    _poolCount = 0;
+}
+
+// Grow the chunk size after _chunkGrowAfter clean chunks in a row, halve it after a
+// short read or a timeout, so a dropped byte on a weak cell costs a small re-request
+void esp32FOTAGSM::_adaptChunkSize(bool clean, size_t minSize, size_t maxSize)
+{
+    size_t size = _chunkSize;
+
+    if (clean)
+    {
+        if (++_cleanChunks < _chunkGrowAfter)
+        {
+            return;
+        }
+        size *= 2;
+    }
+    else
+    {
+        size /= 2;
+    }
+    _cleanChunks = 0;
+
+    if (size > maxSize)
+    {
+        size = maxSize;
+    }
+    if (size < minSize)
+    {
+        size = minSize;
+    }
+    if (size != _chunkSize)
+    {
+        ESP_LOGD(TAG, "Chunk size changed from %u to %u bytes", _chunkSize, size);
+        _chunkSize = size;
+    }
+}
+
+// Stop the writer, free the buffers and drop the partial image
+// (a resumable download keeps its last checkpoint)
+void esp32FOTAGSM::_abortDownload()
+{
+    _stopWriter();
+    _poolRelease();
+    _flashAbort();
+}
+
+// Prepare the sink for an image of size bytes. Normal downloads go through
+// the sink, Update by default. Resumable ones write straight to the next OTA
+// partition, because Update always starts over at byte 0.
+bool esp32FOTAGSM::_flashBegin(size_t size, bool resumable, const char *imageTag)
+{
+    _partition = NULL;
+    _flashOffset = 0;
+
+    if (resumable && _sink == &_updateSink)
+    {
+        return _resumeBegin(esp_ota_get_next_update_partition(NULL), size, imageTag);
+    }
+
+    if (!_sink->begin(size))
+    {
+        return false;
+    }
+
+    // the MD5 of what the sink got is checked before its end()
+    esp_rom_md5_init(&_partMd5);
+    if (_checksum.length() > 0)
+    {
+        ESP_LOGD(TAG, "Checksum: %s", _checksum.c_str());
+    }else{
+        ESP_LOGD(TAG, "No checksum provided");
+    }
+    return true;
+}
+
+// Compare the SHA-256 of the written image with the manifest and check its
+// signature when a public key is set
+bool esp32FOTAGSM::_verifyImage()
+{
+    bool verified = _verifier.finish();
+    if (verified && _publicKey != NULL)
+    {
+        verified = _verifier.verifySignature(_publicKey, _signature.c_str());
+        if (verified)
+        {
+            ESP_LOGD(TAG, "Image signature verified");
+        }
+    }
+    _verifier.release();
+    return verified;
+}
+
+// Write downloaded image bytes, through the decompressor for compressed images.
+// Returns how many of the downloaded bytes were used.
+size_t esp32FOTAGSM::_imageWrite(uint8_t *data, size_t length)
+{
+    unsigned long start = millis();
+    size_t used;
+
+    if (_inflater.isActive())
+    {
+        used = _inflater.write(data, length) ? length : 0;
+        _otaWritten += used;
+    }
+    else if (_patcher.isActive())
+    {
+        used = _decodedWrite(data, length);
+        _otaWritten += used;
+    }
+    else
+    {
+        used = _flashWrite(data, length);
+    }
+
+    _metrics.flashWrites++;
+    _metrics.flashWriteMs += millis() - start;
+    return used;
+}
+
+// Write decompressed bytes, through the patcher for delta updates
+size_t esp32FOTAGSM::_decodedWrite(uint8_t *data, size_t length)
+{
+    if (!_patcher.isActive())
+    {
+        return _flashWrite(data, length);
+    }
+    return _patcher.write(data, length) ? length : 0;
+}
+
+size_t esp32FOTAGSM::_flashWrite(uint8_t *data, size_t length)
+{
+    if (_partition == NULL)
+    {
+        size_t written = _sink->write(data, length);
+        esp_rom_md5_update(&_partMd5, data, written);
+        _verifier.update(data, written);
+        _flashOffset += written;
+        if (!_inflater.isActive() && !_patcher.isActive())
+        {
+            _otaWritten = _flashOffset;
+        }
+        return written;
+    }
+
+    if (_flashOffset + length > _partSize)
+    {
+        ESP_LOGE(TAG, "Image is bigger than announced, dropping %u bytes", _flashOffset + length - _partSize);
+        length = _partSize - _flashOffset;
+    }
+
+    size_t written = 0;
+    while (written < length)
+    {
+        // erase one sector ahead of the write position
+        if (_flashOffset >= _eraseEnd)
+        {
+            esp_err_t err = esp_partition_erase_range(_partition, _eraseEnd, FLASH_SECTOR_SIZE);
+            if (err != ESP_OK)
+            {
+                ESP_LOGE(TAG, "Erasing flash at %u failed: %d", _eraseEnd, err);
+                break;
+            }
+            _eraseEnd += FLASH_SECTOR_SIZE;
+        }
+
+        // never cross the erased sector or a checkpoint boundary in one write
+        size_t nextCheckpoint = (_flashOffset / _checkpointInterval + 1) * _checkpointInterval;
+        size_t n = length - written;
+        if (n > _eraseEnd - _flashOffset)
+        {
+            n = _eraseEnd - _flashOffset;
+        }
+        if (n > nextCheckpoint - _flashOffset)
+        {
+            n = nextCheckpoint - _flashOffset;
+        }
+
+        esp_err_t err = esp_partition_write(_partition, _flashOffset, data + written, n);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Writing flash at %u failed: %d", _flashOffset, err);
+            break;
+        }
+        esp_rom_md5_update(&_partMd5, data + written, n);
+        _verifier.update(data + written, n);
+        _flashOffset += n;
+        written += n;
+
+        if (_flashOffset % _checkpointInterval == 0)
+        {
+            _saveCheckpoint();
+        }
+    }
+
+    _otaWritten = _flashOffset;
+    return written;
+}
+
+// Hex MD5 of what was written to the partition
+static void md5Hex(md5_context_t *context, char *md5)
+{
+    uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+    esp_rom_md5_final(digest, context);
+    for (int i = 0; i < ESP_ROM_MD5_DIGEST_LEN; i++)
+    {
+        sprintf(md5 + 2 * i, "%02x", digest[i]);
+    }
+}
+
+// Finish the image: both paths compare their running MD5, then the sink ends
+// the image or the resumable path switches the boot partition
+bool esp32FOTAGSM::_flashEnd()
+{
+    if (_partition == NULL)
+    {
+        // end() of Update makes the image bootable, check it first
+        char md5[2 * ESP_ROM_MD5_DIGEST_LEN + 1];
+        md5Hex(&_partMd5, md5);
+        if (_checksum.length() > 0 && !_checksum.equalsIgnoreCase(md5))
+        {
+            ESP_LOGE(TAG, "MD5 mismatch, expected %s", _checksum.c_str());
+            _sink->abort();
+            _verifier.release();
+            return false;
+        }
+        if (!_verifyImage())
+        {
+            _sink->abort();
+            return false;
+        }
+        if (!_sink->end())
+        {
+            return false;
+        }
+        ESP_LOGD(TAG, "OTA done!");
+        return true;
+    }
+
+    const esp_partition_t *partition = _partition;
+    _partition = NULL;
+
+    if (_flashOffset != _partSize)
+    {
+        // keep the checkpoint, the next attempt continues from there
+        ESP_LOGD(TAG, "Image incomplete: %u of %u bytes", _flashOffset, _partSize);
+        return false;
+    }
+
+    // from here on the image is either installed or useless
+    _clearCheckpoint();
+
+    char md5[2 * ESP_ROM_MD5_DIGEST_LEN + 1];
+    md5Hex(&_partMd5, md5);
+    ESP_LOGD(TAG, "Update MD5: %s", md5);
+
+    if (_checksum.length() > 0 && !_checksum.equalsIgnoreCase(md5))
+    {
+        ESP_LOGE(TAG, "MD5 mismatch, expected %s", _checksum.c_str());
+        return false;
+    }
+    if (!_verifyImage())
+    {
+        return false;
+    }
+
+    // esp_ota_set_boot_partition() also validates the image
+    esp_err_t err = esp_ota_set_boot_partition(partition);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Could not set the boot partition: %d", err);
+        return false;
+    }
+    ESP_LOGD(TAG, "OTA done!");
+    return true;
+}
+
+// Finish a written image, for compressed and patched images after the last
+// bytes are decoded. complete is false if the download was incomplete.
+bool esp32FOTAGSM::_finishImage(bool encoded, bool complete)
+{
+    if (!complete)
+    {
+        // a truncated image is never ended, the sink would take it as done
+        ESP_LOGE(TAG, "Image incomplete, not installed");
+        _flashAbort();
+        return false;
+    }
+    if (!encoded)
+    {
+        return _flashEnd();
+    }
+
+    // the size check applies to the decoded output
+    if (_inflater.isActive())
+    {
+        complete = _inflater.end() && complete;
+        ESP_LOGD(TAG, "Decompressed into %u bytes", _inflater.outputSize());
+    }
+    size_t imageWritten = _inflater.outputSize();
+    if (_patcher.isActive())
+    {
+        complete = _patcher.end() && complete;
+        imageWritten = _patcher.outputSize();
+    }
+    _inflater.release();
+    _patcher.release();
+
+    if (!complete || (_imageSize > 0 && imageWritten != _imageSize))
+    {
+        ESP_LOGE(TAG, "Decoded image is incomplete or has the wrong size");
+        _flashAbort();
+        return false;
+    }
+    return _flashEnd();
+}
+
+// Install a download that is complete in the staging partition: decode it if
+// needed and write it with Update, which takes seconds instead of the length of
+// the download. The staged copy is kept until it is installed, so an interrupted
+// install starts over without downloading again.
+bool esp32FOTAGSM::_installStaged(bool delta, esp32FOTAGSMInflater::Format compression, size_t imageSize)
+{
+    const esp_partition_t *stage = _partition;
+    size_t stagedSize = _partSize;
+    _partition = NULL;
+
+    if (_flashOffset != stagedSize)
+    {
+        ESP_LOGD(TAG, "Staged download incomplete: %u of %u bytes", _flashOffset, stagedSize);
+        return false;
+    }
+    _saveCheckpoint();
+
+    // a plain image can be checked before anything is flashed
+    bool encoded = delta || compression != esp32FOTAGSMInflater::FORMAT_NONE;
+    char md5[2 * ESP_ROM_MD5_DIGEST_LEN + 1];
+    md5_context_t context = _partMd5;
+    md5Hex(&context, md5);
+    if (!encoded && _checksum.length() > 0 && !_checksum.equalsIgnoreCase(md5))
+    {
+        ESP_LOGE(TAG, "MD5 of the staged image is %s, expected %s", md5, _checksum.c_str());
+        _clearCheckpoint();
+        return false;
+    }
+
+    ESP_LOGD(TAG, "Installing %u staged bytes from %s", stagedSize, stage->label);
+    if (((_sha256.length() > 0 || _publicKey != NULL) && !_verifier.begin(_sha256.c_str())) ||
+        !_flashBegin(imageSize, false, ""))
+    {
+        ESP_LOGE(TAG, "Not enough space to begin OTA");
+        _verifier.release();
+        return false;
+    }
+    if ((delta && !_patcher.begin([this](uint8_t *data, size_t length)
+                                  { return _flashWrite(data, length); })) ||
+        (compression != esp32FOTAGSMInflater::FORMAT_NONE &&
+         !_inflater.begin(compression, [this](uint8_t *data, size_t length)
+                          { return _decodedWrite(data, length); }, _poolUsePSRAM)) ||
+        _poolAcquire(1) == 0)
+    {
+        _flashAbort();
+        return false;
+    }
+
+    size_t offset = 0;
+    while (offset < stagedSize)
+    {
+        size_t length = stagedSize - offset < _poolBufferSize ? stagedSize - offset : _poolBufferSize;
+        if (esp_partition_read(stage, offset, _poolBuffers[0], length) != ESP_OK ||
+            _imageWrite(_poolBuffers[0], length) != length)
+        {
+            ESP_LOGE(TAG, "Installing the staged image failed at byte %u", offset);
+            break;
+        }
+        offset += length;
+    }
+    _poolRelease();
+
+    bool installed = _finishImage(encoded, offset == stagedSize);
+    // a staged image that does not install is not tried again
+    _clearCheckpoint();
+    return installed;
+}
+
+void esp32FOTAGSM::_flashAbort()
+{
+    _inflater.release();
+    _patcher.release();
+    _verifier.release();
+
+    if (_partition == NULL)
+    {
+        _sink->abort();
+        return;
+    }
+
+    // the partition and the checkpoint stay as they are for the next attempt
+    ESP_LOGD(TAG, "Download stopped, resumable from byte %u", _flashOffset - _flashOffset % _checkpointInterval);
+    _partition = NULL;
+}
+
+// Look for a checkpoint of the same image in NVS and continue from it, or start
+// a new checkpoint. The image is identified by its URL, length, ETag/Last-Modified
+// and MD5; without either a tag or an MD5 a partial image is never reused.
+bool esp32FOTAGSM::_resumeBegin(const esp_partition_t *partition, size_t size, const char *imageTag)
+{
+    if (partition == NULL || size > partition->size)
+    {
+        ESP_LOGE(TAG, "No partition big enough for %u bytes", size);
+        return false;
+    }
+
+    // the manifest host, whichever mirror serves the image
+    String url = _mirrorHosts[0] + ":" + String(_mirrorPorts[0]) + _downloadPath;
+    ResumeState state;
+    Preferences prefs;
+    if (!prefs.begin(RESUME_NVS_NAMESPACE, false))
+    {
+        ESP_LOGE(TAG, "Could not open NVS namespace %s", RESUME_NVS_NAMESPACE);
+        return false;
+    }
+
+    bool sameImage = (imageTag[0] != 0 || _checksum.length() > 0) &&
+                     prefs.getString("url") == url &&
+                     prefs.getString("label") == partition->label &&
+                     prefs.getUInt("len") == size &&
+                     prefs.getString("tag") == imageTag &&
+                     prefs.getString("md5") == _checksum &&
+                     prefs.getBytes("state", &state, sizeof(state)) == sizeof(state) &&
+                     state.offset <= size &&
+                     (state.offset % FLASH_SECTOR_SIZE == 0 || state.offset == size);
+
+    if (sameImage)
+    {
+        ESP_LOGI(TAG, "Resuming download at byte %u of %u", state.offset, size);
+        _flashOffset = state.offset;
+        _partMd5 = state.md5;
+        // the SHA-256 state is not checkpointed, hash what is already written
+        _verifier.updateFromPartition(partition, _flashOffset);
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Starting a new resumable download into %s", partition->label);
+        prefs.clear();
+        prefs.putString("url", url);
+        prefs.putString("label", partition->label);
+        prefs.putUInt("len", size);
+        prefs.putString("tag", imageTag);
+        prefs.putString("md5", _checksum);
+        _flashOffset = 0;
+        esp_rom_md5_init(&_partMd5);
+    }
+    prefs.end();
+
+    // anything written after the checkpoint is erased again before use
+    _eraseEnd = _flashOffset;
+    _partition = partition;
+    _partSize = size;
+    _otaWritten = _flashOffset;
+
+    if (!sameImage)
+    {
+        _saveCheckpoint();
+    }
+    return true;
+}
+
+// Offset and MD5 state go into one blob so they are always committed together
+void esp32FOTAGSM::_saveCheckpoint()
+{
+    ResumeState state;
+    state.offset = _flashOffset;
+    state.md5 = _partMd5;
+
+    Preferences prefs;
+    if (prefs.begin(RESUME_NVS_NAMESPACE, false))
+    {
+        prefs.putBytes("state", &state, sizeof(state));
+        prefs.end();
+        ESP_LOGD(TAG, "Checkpoint at byte %u", _flashOffset);
+    }
+}
+
+void esp32FOTAGSM::_clearCheckpoint()
+{
+    Preferences prefs;
+    if (prefs.begin(RESUME_NVS_NAMESPACE, false))
+    {
+        prefs.clear();
+        prefs.end();
+    }
+}
+
+// Start the flash writer task cycling through the pool buffers.
+// Returns false if the queues or the task could not be created.
+bool esp32FOTAGSM::_startWriter()
+{
+    _writerWritten = 0;
+    _writerFailed = false;
+
+    _freeBuffers = xQueueCreate(_poolCount, sizeof(uint8_t *));
+    _filledBuffers = xQueueCreate(_poolCount + 1, sizeof(WriterChunk));
+    _writerDone = xSemaphoreCreateBinary();
+    if (_freeBuffers == NULL || _filledBuffers == NULL || _writerDone == NULL)
+    {
+        ESP_LOGE(TAG, "Not enough memory for the writer queues, writing to flash in line");
+        _releaseWriterResources();
+        return false;
+    }
+
+    for (uint8_t i = 0; i < _poolCount; i++)
+    {
+        xQueueSend(_freeBuffers, &_poolBuffers[i], 0);
+    }
+
+    if (xTaskCreate(_writerTask, "esp32FOTAGSMwr", 6144, this, uxTaskPriorityGet(NULL), &_writerTaskHandle) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Could not create the writer task");
+        _writerTaskHandle = NULL;
+        _releaseWriterResources();
+        return false;
+    }
+
+    ESP_LOGD(TAG, "Writer task started with %u buffers", _poolCount);
+    return true;
+}
+
+// Flush the queued chunks to flash and stop the writer task.
+// Returns false if any flash write failed. Safe to call when no writer is running.
+bool esp32FOTAGSM::_stopWriter()
+{
+    if (_writerTaskHandle == NULL)
+    {
+        return true;
+    }
+
+    WriterChunk endMarker = {NULL, 0};
+    xQueueSend(_filledBuffers, &endMarker, portMAX_DELAY);
+    xSemaphoreTake(_writerDone, portMAX_DELAY);
+    _writerTaskHandle = NULL;
+
+    _releaseWriterResources();
+    return !_writerFailed;
+}
+
+void esp32FOTAGSM::_releaseWriterResources()
+{
+    if (_freeBuffers != NULL)
+    {
+        vQueueDelete(_freeBuffers);
+        _freeBuffers = NULL;
+    }
+    if (_filledBuffers != NULL)
+    {
+        vQueueDelete(_filledBuffers);
+        _filledBuffers = NULL;
+    }
+    if (_writerDone != NULL)
+    {
+        vSemaphoreDelete(_writerDone);
+        _writerDone = NULL;
+    }
+}
+
+// Blocks until the writer task gives a buffer back
+uint8_t *esp32FOTAGSM::_acquireBuffer()
+{
+    uint8_t *buffer = NULL;
+    xQueueReceive(_freeBuffers, &buffer, portMAX_DELAY);
+    return buffer;
+}
+
+void esp32FOTAGSM::_submitBuffer(uint8_t *buffer, size_t length)
+{
+    if (length == 0)
+    {
+        // nothing to write, the buffer goes straight back to the pool
+        xQueueSend(_freeBuffers, &buffer, portMAX_DELAY);
+        return;
+    }
+
+    WriterChunk chunk = {buffer, length};
+    xQueueSend(_filledBuffers, &chunk, portMAX_DELAY);
+}
+
+void esp32FOTAGSM::_writerTask(void *param)
+{
+    esp32FOTAGSM *self = static_cast<esp32FOTAGSM *>(param);
+    WriterChunk chunk;
+
+    while (xQueueReceive(self->_filledBuffers, &chunk, portMAX_DELAY) == pdTRUE)
+    {
+        if (chunk.data == NULL)
+        {
+            break;
+        }
+
+        // after a failed write the remaining chunks are only drained
+        if (!self->_writerFailed)
+        {
+            size_t written = self->_imageWrite(chunk.data, chunk.length);
+            self->_writerWritten += written;
+
+            if (written != chunk.length)
+            {
+                ESP_LOGE(TAG, "Expected to write %u bytes but %u were written", chunk.length, written);
+                self->_writerFailed = true;
+            }
+            else
+            {
+                ESP_LOGD(TAG, "Written %u bytes to flash", self->_writerWritten);
+            }
+        }
+
+        xQueueSend(self->_freeBuffers, &chunk.data, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(self->_writerDone);
+    vTaskDelete(NULL);
+}
+
+// Blocking OTA: download, flash and reboot on success
+bool esp32FOTAGSM::execOTA()
+{
+    if (isOTARunning())
+    {
+        ESP_LOGE(TAG, "An OTA task is already running");
+        return false;
+    }
+
+    // cleared before the run, an abortOTA() from another task counts from here
+    _abortRequested = false;
+    if (_runOTA())
+    {
+        ESP_LOGD(TAG, "Update successfully completed. Rebooting.");
+        ESP.restart();
+        return true;
+    }
+    return false;
+}
+
+// Non-blocking OTA: runs the update in its own task. The application is notified
+// through the completion callback and decides when to reboot.
+bool esp32FOTAGSM::startOTA(BaseType_t core, uint32_t stackSize, UBaseType_t priority)
+{
+    if (isOTARunning())
+    {
+        ESP_LOGE(TAG, "An OTA task is already running");
+        return false;
+    }
+
+    // cleared before the task exists, so an abortOTA() right after this returns is kept
+    _abortRequested = false;
+    _setState(OTA_CONNECTING);
+    if (xTaskCreatePinnedToCore(_otaTask, "esp32FOTAGSM", stackSize, this, priority, &_otaTaskHandle, core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Could not create the OTA task");
+        _otaTaskHandle = NULL;
+        _setState(OTA_FAILED);
+        return false;
+    }
+    return true;
+}
+
+void esp32FOTAGSM::_otaTask(void *param)
+{
+    esp32FOTAGSM *self = static_cast<esp32FOTAGSM *>(param);
+
+    if (self->_polling)
+    {
+        self->_pollLoop();
+    }
+    else
+    {
+        self->_runOTA();
+
+        if (self->_completionCallback != NULL)
+        {
+            self->_completionCallback(self->_state);
+        }
+    }
+
+    self->_polling = false;
+    self->_otaTaskHandle = NULL;
+    vTaskDelete(NULL);
+}
+
+// Call early in setup(). If this is the first firmware run after an update,
+// it stays on probation until confirmUpdate(), which the first answered
+// manifest check calls once the health check passes. The previous firmware is
+// booted again if there is no confirmation within timeoutMs, after maxBoots
+// resets or with rejectUpdate(). Returns true while on probation.
+bool esp32FOTAGSM::beginValidation(unsigned long timeoutMs, uint8_t maxBoots)
+{
+    Preferences prefs;
+    if (_validating || !prefs.begin(ROLLBACK_NVS_NAMESPACE, false))
+    {
+        return _validating;
+    }
+    if (!prefs.getBool("pending", false))
+    {
+        prefs.end();
+        return false;
+    }
+
+    // the bootloader already went back, or the new firmware never started
+    if (prefs.getString("prev") == esp_ota_get_running_partition()->label)
+    {
+        prefs.end();
+        ESP_LOGW(TAG, "The update did not boot");
+        _saveOutcome("reverted", true);
+        return false;
+    }
+
+    uint8_t boots = prefs.getUChar("boots") + 1;
+    prefs.putUChar("boots", boots);
+    prefs.end();
+
+    _validating = true;
+    if (boots > maxBoots)
+    {
+        ESP_LOGE(TAG, "The update reset %u times without being confirmed", boots - 1);
+        rejectUpdate();
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Validating the update, boot %u", boots);
+    this->_validationTimeoutMs = timeoutMs;
+    if (xTaskCreate(_validationTask, "esp32FOTAGSMval", 4096, this, 1, &_validationTaskHandle) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Could not create the validation task");
+        _validationTaskHandle = NULL;
+    }
+    return true;
+}
+
+// Reverts the update unless confirmUpdate() notifies the task in time
+void esp32FOTAGSM::_validationTask(void *param)
+{
+    esp32FOTAGSM *self = static_cast<esp32FOTAGSM *>(param);
+
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(self->_validationTimeoutMs)) == 0 && self->_validating)
+    {
+        ESP_LOGE(TAG, "The update was not confirmed within %lu ms", self->_validationTimeoutMs);
+        self->rejectUpdate();
+    }
+
+    self->_validationTaskHandle = NULL;
+    vTaskDelete(NULL);
+}
+
+// Checked with every answered manifest check while on probation, the update is
+// confirmed once it returns true
+void esp32FOTAGSM::setHealthCheck(THealthCheckFunction healthCheckFunction)
+{
+    this->_healthCheckFunction = healthCheckFunction;
+}
+
+bool esp32FOTAGSM::isValidating()
+{
+    return _validating;
+}
+
+// Keep the running firmware, it is reported as confirmed with the next check
+void esp32FOTAGSM::confirmUpdate()
+{
+    if (!_validating)
+    {
+        return;
+    }
+    _validating = false;
+    esp_ota_mark_app_valid_cancel_rollback();
+    _saveOutcome("confirmed", false);
+    ESP_LOGI(TAG, "Update confirmed");
+
+    TaskHandle_t task = _validationTaskHandle;
+    if (task != NULL)
+    {
+        xTaskNotifyGive(task);
+    }
+}
+
+// Boot the previous firmware again: through the bootloader rollback when the
+// image is pending verification, else by switching the boot partition back.
+// Does not return unless the previous firmware cannot be booted.
+void esp32FOTAGSM::rejectUpdate()
+{
+    if (!_validating)
+    {
+        return;
+    }
+    _validating = false;
+
+    Preferences prefs;
+    String previousLabel;
+    if (prefs.begin(ROLLBACK_NVS_NAMESPACE, true))
+    {
+        previousLabel = prefs.getString("prev");
+        prefs.end();
+    }
+    _saveOutcome("reverted", true);
+
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        ESP_LOGE(TAG, "Rolling back the update");
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+
+    const esp_partition_t *previous = previousLabel.length() > 0
+                                          ? esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, previousLabel.c_str())
+                                          : NULL;
+    // esp_ota_set_boot_partition() also checks the old image
+    if (previous == NULL || esp_ota_set_boot_partition(previous) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot boot the previous firmware");
+        return;
+    }
+    ESP_LOGE(TAG, "Booting the previous firmware from %s", previous->label);
+    ESP.restart();
+}
+
+// Run execHTTPcheck() every poll interval in the OTA task and install the
+// updates it finds, failed checks and updates back off exponentially
+bool esp32FOTAGSM::startPolling(BaseType_t core, uint32_t stackSize, UBaseType_t priority)
+{
+    if (isOTARunning())
+    {
+        ESP_LOGE(TAG, "An OTA task is already running");
+        return false;
+    }
+
+    _polling = true;
+    _pollStop = false;
+    _abortRequested = false;
+    if (xTaskCreatePinnedToCore(_otaTask, "esp32FOTAGSM", stackSize, this, priority, &_otaTaskHandle, core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Could not create the OTA task");
+        _otaTaskHandle = NULL;
+        _polling = false;
+        return false;
+    }
+    return true;
+}
+
+// Stop polling after the current check. An update in progress is finished,
+// use abortOTA() to stop it as well.
+void esp32FOTAGSM::stopPolling()
+{
+    _pollStop = true;
+    TaskHandle_t task = _otaTaskHandle;
+    if (_polling && task != NULL)
+    {
+        xTaskNotifyGive(task);
+    }
+}
+
+bool esp32FOTAGSM::isPolling()
+{
+    return _polling;
+}
+
+// Ask a running update to stop, also one startOTA() created that has not
+// begun yet. The download gives the client and the network semaphore back at
+// the next chunk or retry.
+void esp32FOTAGSM::abortOTA()
+{
+    _abortRequested = true;
+    // end a wait of the OTA task early
+    TaskHandle_t task = _otaTaskHandle;
+    if (task != NULL)
+    {
+        xTaskNotifyGive(task);
+    }
+}
+
+bool esp32FOTAGSM::isOTARunning()
+{
+    return _otaTaskHandle != NULL;
+}
+
+esp32FOTAGSM::OTAState esp32FOTAGSM::getState()
+{
+    return _state;
+}
+
+// Progress in percent, -1 while the image size is not known yet
+int esp32FOTAGSM::getProgress()
+{
+    if (_otaSize == 0)
+    {
+        return -1;
+    }
+    return (int)((uint64_t)_otaWritten * 100 / _otaSize);
+}
+
+size_t esp32FOTAGSM::getBytesWritten()
+{
+    return _otaWritten;
+}
+
+size_t esp32FOTAGSM::getImageSize()
+{
+    return _otaSize;
+}
+
+void esp32FOTAGSM::_setState(OTAState state)
+{
+    _state = state;
+}
+
+void esp32FOTAGSM::_pollLoop()
+{
+    uint16_t failures = 0;
+    // devices started together (e.g. after a power cut) spread their first check
+    unsigned long waitMs = _random() % (_pollIntervalMs / 100 * _jitterPercent + 1);
+
+    while (_pollWait(waitMs))
+    {
+        // with a link policy, only check (and download) on a usable link
+        if (_linkQualityFunction != NULL && !_linkUsable(_linkQualityFunction()))
+        {
+            ESP_LOGD(TAG, "Link unusable, checking again in %d ms", LINK_RECHECK_MS);
+            waitMs = LINK_RECHECK_MS;
+            continue;
+        }
+
+        bool updateAvailable = execHTTPcheck();
+        bool failed = _checkFailed;
+
+        if (updateAvailable && !_pollStop)
+        {
+            _runOTA();
+            if (_completionCallback != NULL)
+            {
+                _completionCallback(_state);
+            }
+            if (_state == OTA_DONE)
+            {
+                // the new firmware is installed, it runs after the reboot
+                break;
+            }
+            // an aborted update is tried again at the next poll
+            failed = _state == OTA_FAILED;
+            _abortRequested = false;
+        }
+
+        failures = failed ? failures + 1 : 0;
+        if (failures > 0)
+        {
+            // retried sooner than the next poll at first, backing off up to maxBackoffMs
+            waitMs = _nextDelay(_retryDelayMs, failures, _pollMaxBackoffMs);
+            ESP_LOGD(TAG, "Check failed %u times, next one in %lu ms", failures, waitMs);
+        }
+        else
+        {
+            waitMs = _nextDelay(_pollIntervalMs, 1, _pollIntervalMs);
+            ESP_LOGD(TAG, "Next check in %lu ms", waitMs);
+        }
+    }
+}
+
+// Sleep until the next poll, false when polling was stopped
+bool esp32FOTAGSM::_pollWait(unsigned long ms)
+{
+    _idleWait(ms, _pollStop, true);
+    return !_pollStop;
+}
+
+// Wait ms with nothing to send or receive, or until stop is set. Waits of at
+// least the minimum sleep time put the modem to sleep (if modemSleep and there
+// is a modem sleep function) and the chip into light sleep with SLEEP_LIGHT,
+// waking on the timer or on modem UART data. Returns the time spent asleep.
+unsigned long esp32FOTAGSM::_idleWait(unsigned long ms, const volatile bool &stop, bool modemSleep)
+{
+    bool sleep = ms >= _sleepMinMs;
+    bool lightSleep = sleep && _sleepMode == SLEEP_LIGHT;
+    modemSleep = sleep && modemSleep && _modemSleepFunction != NULL;
+    if (modemSleep)
+    {
+        _modemSleepFunction(true);
+    }
+
+    unsigned long start = millis();
+    unsigned long elapsed;
+    unsigned long slept = 0;
+    while (!stop && (elapsed = millis() - start) < ms)
+    {
+        unsigned long remaining = ms - elapsed;
+        if (lightSleep)
+        {
+            // other tasks are stopped as well until the chip wakes up
+            esp_sleep_enable_timer_wakeup((uint64_t)remaining * 1000);
+            if (_wakeupUart >= 0)
+            {
+                uart_set_wakeup_threshold(_wakeupUart, UART_WAKEUP_THRESHOLD);
+                esp_sleep_enable_uart_wakeup(_wakeupUart);
+            }
+            unsigned long sleepStart = millis();
+            esp_light_sleep_start();
+            slept += millis() - sleepStart;
+            // the sleep configuration is global, leave none of it to the application
+            esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+            if (_wakeupUart >= 0)
+            {
+                esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_UART);
+            }
+            if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UART)
+            {
+                // the modem has something to say, give its driver the rest of the wait
+                ESP_LOGD(TAG, "Woken by the modem after %lu ms", slept);
+                lightSleep = false;
+            }
+        }
+        else
+        {
+            // abortOTA() and stopPolling() notify the task, data notifications just wake it early
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(remaining < IDLE_POLL_MS ? remaining : IDLE_POLL_MS));
+        }
+    }
+
+    if (modemSleep)
+    {
+        _modemSleepFunction(false);
+        return millis() - start;
+    }
+    return slept;
+}
+
+// baseMs doubled for every attempt after the first, at most maxMs, with jitter.
+// A Retry-After from the server takes precedence when it is longer.
+unsigned long esp32FOTAGSM::_nextDelay(unsigned long baseMs, uint16_t attempt, unsigned long maxMs)
+{
+    unsigned long delayMs = baseMs;
+    for (uint16_t i = 1; i < attempt && delayMs < maxMs; i++)
+    {
+        delayMs *= 2;
+    }
+    if (delayMs > maxMs)
+    {
+        delayMs = maxMs;
+    }
+    delayMs = _jitter(delayMs);
+
+    if (_retryAfterMs > delayMs)
+    {
+        delayMs = _retryAfterMs;
+    }
+    _retryAfterMs = 0;
+    return delayMs;
+}
+
+// ms plus or minus up to _jitterPercent, so a fleet does not retry in lockstep
+unsigned long esp32FOTAGSM::_jitter(unsigned long ms)
+{
+    unsigned long span = ms / 100 * _jitterPercent;
+    if (span == 0)
+    {
+        return ms;
+    }
+    return ms - span + _random() % (2 * span + 1);
+}
+
+// xorshift32, seeded from the device ID so devices get different sequences
+uint32_t esp32FOTAGSM::_random()
+{
+    if (_randomState == 0)
+    {
+        String deviceID = _getDeviceID();
+        _randomState = 2166136261u;
+        for (size_t i = 0; i < deviceID.length(); i++)
+        {
+            _randomState = (_randomState ^ (uint8_t)deviceID[i]) * 16777619u;
+        }
+        if (_randomState == 0)
+        {
+            _randomState = 1;
+        }
+    }
+
+    _randomState ^= _randomState << 13;
+    _randomState ^= _randomState >> 17;
+    _randomState ^= _randomState << 5;
+    return _randomState;
+}
+
+// Wait before retrying a failed chunk. Returns false if the update should give up,
+// either because it was aborted or because the retry budget is spent.
+bool esp32FOTAGSM::_retryWait(uint16_t &retries)
+{
+    retries++;
+    _metrics.retries++;
+    if (_maxRetries > 0 && retries > _maxRetries)
+    {
+        ESP_LOGE(TAG, "Giving up after %u retries", retries - 1);
+        return false;
+    }
+
+    // Range requests let another mirror continue where this one failed
+    if (_mirrorCount > 1 && retries % MIRROR_FAILOVER_RETRIES == 0)
+    {
+        _sessionClose();
+        _useMirror((_mirror + 1) % _mirrorCount);
+        _metrics.mirrorSwitches++;
+        ESP_LOGW(TAG, "Switching to mirror %s:%d", _host.c_str(), _port);
+    }
+
+    unsigned long delayMs = _nextDelay(_retryDelayMs, retries, _maxRetryDelayMs);
+    ESP_LOGD(TAG, "Retry %u in %lu ms", retries, delayMs);
+
+    _metrics.sleepMs += _idleWait(delayMs, _abortRequested, true);
+    return !_abortRequested;
+}
+
+// Use the mirror that was fastest for the last update, or connect to each one
+// with a HEAD request of the image and take the one that answers first
+void esp32FOTAGSM::_selectMirror()
+{
+    if (_mirrorCount <= 1)
+    {
+        _useMirror(0);
+        return;
+    }
+
+    Preferences prefs;
+    String winnerHost;
+    int winnerPort = 0;
+    if (prefs.begin(MIRROR_NVS_NAMESPACE, true))
+    {
+        winnerHost = prefs.getString("host");
+        winnerPort = prefs.getInt("port");
+        prefs.end();
+    }
+    for (uint8_t i = 0; i < _mirrorCount; i++)
+    {
+        if (_mirrorHosts[i] == winnerHost && _mirrorPorts[i] == winnerPort)
+        {
+            ESP_LOGD(TAG, "Using mirror %s:%d from the last update", winnerHost.c_str(), winnerPort);
+            _useMirror(i);
+            return;
+        }
+    }
+
+    uint8_t best = 0;
+    long bestMs = -1;
+    for (uint8_t i = 0; i < _mirrorCount && !_abortRequested; i++)
+    {
+        long ms = _probeMirror(i);
+        if (ms >= 0 && (bestMs < 0 || ms < bestMs))
+        {
+            best = i;
+            bestMs = ms;
+        }
+    }
+    ESP_LOGD(TAG, "Using mirror %s:%d", _mirrorHosts[best].c_str(), _mirrorPorts[best]);
+    // the connection of the last probe is only of use if that mirror won
+    if (_sessionHost != _mirrorHosts[best] || _sessionPort != _mirrorPorts[best])
+    {
+        _sessionClose();
+    }
+    _useMirror(best);
+}
+
+// Time to connect to a mirror and get the headers of the image, -1 if it failed.
+// With keep-alive the connection stays open, the next probe or the download
+// closes it unless they go to the same mirror.
+long esp32FOTAGSM::_probeMirror(uint8_t mirror)
+{
+    HTTPResponse response;
+    unsigned long start = millis();
+
+    _blockingNetworkSemaphoreTake();
+    bool answered = _sessionConnect(_mirrorHosts[mirror], _mirrorPorts[mirror]);
+    if (answered)
+    {
+        _requestBegin("HEAD", _mirrorHosts[mirror], _bin.c_str());
+        answered = _requestSend(_keepAlive) && _waitForData(MIRROR_PROBE_TIMEOUT_MS) && _readResponseHeaders(response) && response.status == 200;
+    }
+    long elapsed = millis() - start;
+    if (!answered || !_keepAlive || !response.keepAlive)
+    {
+        _sessionClose();
+    }
+    _blockingNetworkSemaphoreGive();
+
+    if (!answered)
+    {
+        ESP_LOGW(TAG, "Mirror %s:%d failed", _mirrorHosts[mirror].c_str(), _mirrorPorts[mirror]);
+        return -1;
+    }
+    ESP_LOGD(TAG, "Mirror %s:%d answered in %ld ms", _mirrorHosts[mirror].c_str(), _mirrorPorts[mirror], elapsed);
+    return elapsed;
+}
+
+void esp32FOTAGSM::_useMirror(uint8_t mirror)
+{
+    if (mirror < _mirrorCount)
+    {
+        _mirror = mirror;
+        _host = _mirrorHosts[mirror];
+        _port = _mirrorPorts[mirror];
+    }
+}
+
+// Remember the mirror that completed the update, or forget it after a failed
+// one so that the next update probes all of them again
+void esp32FOTAGSM::_saveMirror(bool winner)
+{
+    Preferences prefs;
+    if (_mirrorCount <= 1 || !prefs.begin(MIRROR_NVS_NAMESPACE, false))
+    {
+        return;
+    }
+    if (winner)
+    {
+        prefs.putString("host", _host);
+        prefs.putInt("port", _port);
+    }
+    else
+    {
+        prefs.clear();
+    }
+    prefs.end();
+}
+
+// Download the other images of the update one after the other, over the same
+// connection when the server keeps it alive. Each one is checked by its sink
+// but none is committed yet.
+bool esp32FOTAGSM::_downloadTargets()
+{
+    for (uint8_t i = 0; i < _targetCount; i++)
+    {
+        _targets[i].state = TARGET_IDLE;
+    }
+
+    for (uint8_t i = 0; i < _targetCount; i++)
+    {
+        Target &target = _targets[i];
+        if (target.bin.length() == 0)
+        {
+            continue;
+        }
+
+        ESP_LOGD(TAG, "Downloading target %s: %s", target.name.c_str(), target.bin.c_str());
+        uint16_t retries = 0;
+        while (!_fetchTarget(target))
+        {
+            if (_abortRequested || !_retryWait(retries))
+            {
+                ESP_LOGE(TAG, "Target %s failed", target.name.c_str());
+                target.state = TARGET_FAILED;
+                return false;
+            }
+        }
+    }
+    _otaWritten = 0;
+    _otaSize = 0;
+    return true;
+}
+
+// Get one target with a single GET into its sink, true once the sink ended it
+bool esp32FOTAGSM::_fetchTarget(Target &target)
+{
+    if (_poolAcquire(1) == 0)
+    {
+        ESP_LOGE(TAG, "Not enough memory for the download buffer");
+        return false;
+    }
+
+    _blockingNetworkSemaphoreTake();
+    if (!_sessionConnect(_host, _port))
+    {
+        ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
+        _blockingNetworkSemaphoreGive();
+        _poolRelease();
+        return false;
+    }
+
+    _requestBegin("GET", _host, target.bin.c_str());
+
+    HTTPResponse response;
+    bool started = _requestSend(_keepAlive) && _waitForResponse() && _readResponseHeaders(response) && response.status == 200 &&
+                   response.contentLength > 0 &&
+                   (target.size == 0 || (size_t)response.contentLength == target.size) &&
+                   target.sink->begin(response.contentLength);
+    target.state = started ? TARGET_STARTED : TARGET_FAILED;
+
+    md5_context_t md5;
+    esp_rom_md5_init(&md5);
+    size_t total = 0;
+    _otaSize = started ? response.contentLength : 0;
+    _otaWritten = 0;
+    while (started && total < (size_t)response.contentLength)
+    {
+        unsigned long start = millis();
+        if (_abortRequested || !_waitForData(CLIENT_TIMEOUT_MS))
+        {
+            break;
+        }
+
+        size_t length = response.contentLength - total;
+        if (length > _poolBufferSize)
+        {
+            length = _poolBufferSize;
+        }
+        int received = _client->read(_poolBuffers[0], length);
+        _metrics.receiveMs += millis() - start;
+        if (received <= 0)
+        {
+            continue;
+        }
+        _metrics.bytesReceived += received;
+        esp_rom_md5_update(&md5, _poolBuffers[0], received);
+
+        start = millis();
+        size_t written = target.sink->write(_poolBuffers[0], received);
+        _metrics.flashWrites++;
+        _metrics.flashWriteMs += millis() - start;
+        if (written != (size_t)received)
+        {
+            ESP_LOGE(TAG, "Writing target %s failed", target.name.c_str());
+            break;
+        }
+        total += received;
+        _otaWritten = total;
+    }
+
+    bool complete = started && total == (size_t)response.contentLength;
+    if (!complete || !_keepAlive || !response.keepAlive)
+    {
+        _sessionClose();
+    }
+    else
+    {
+        _sessionUpdate(response);
+    }
+    _blockingNetworkSemaphoreGive();
+    _poolRelease();
+
+    if (complete)
+    {
+        char checksum[2 * ESP_ROM_MD5_DIGEST_LEN + 1];
+        md5Hex(&md5, checksum);
+        if (target.checksum.length() > 0 && !target.checksum.equalsIgnoreCase(checksum))
+        {
+            ESP_LOGE(TAG, "MD5 of target %s mismatch, expected %s", target.name.c_str(), target.checksum.c_str());
+            complete = false;
+        }
+        else if (!target.sink->end())
+        {
+            ESP_LOGE(TAG, "Target %s was rejected by its sink", target.name.c_str());
+            complete = false;
+        }
+        else
+        {
+            target.state = TARGET_ENDED;
+        }
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Target %s incomplete: %u bytes", target.name.c_str(), total);
+    }
+
+    if (!complete && started)
+    {
+        target.sink->abort();
+        target.state = TARGET_FAILED;
+    }
+    return complete;
+}
+
+// Commit the other images once the application image ended as well, or discard
+// the ones that were begun. Update makes the application bootable in end(), a
+// sink of setSink() is committed last. If a commit fails the boot partition is
+// switched back or the application sink aborted, and the rest is discarded, so
+// the running firmware only has to cope with the targets committed before,
+// which getTargetState() reports.
+bool esp32FOTAGSM::_finishTargets(bool success)
+{
+    bool committed = false;
+    for (uint8_t i = 0; i < _targetCount; i++)
+    {
+        Target &target = _targets[i];
+        if (success && target.state == TARGET_ENDED)
+        {
+            if (target.sink->commit())
+            {
+                target.state = TARGET_COMMITTED;
+                committed = true;
+                continue;
+            }
+            ESP_LOGE(TAG, "Could not commit target %s, keeping the running firmware", target.name.c_str());
+            if (_sink == &_updateSink)
+            {
+                esp_ota_set_boot_partition(esp_ota_get_running_partition());
+            }
+            else
+            {
+                _sink->abort();
+            }
+            success = false;
+        }
+        if (target.state == TARGET_STARTED || target.state == TARGET_ENDED)
+        {
+            target.sink->abort();
+            target.state = TARGET_FAILED;
+        }
+    }
+
+    if (success && _sink != &_updateSink && !_sink->commit())
+    {
+        ESP_LOGE(TAG, "Could not commit the application image");
+        success = false;
+    }
+
+    for (uint8_t i = 0; i < _targetCount && !success && committed; i++)
+    {
+        if (_targets[i].state == TARGET_COMMITTED)
+        {
+            ESP_LOGE(TAG, "Target %s stays committed", _targets[i].name.c_str());
+        }
+    }
+    return success;
+}
+
+bool esp32FOTAGSM::_runOTA()
+{
+    unsigned long start = millis();
+    _metrics = OTAMetrics();
+    _otaWritten = 0;
+    _otaSize = 0;
+    _setState(OTA_CONNECTING);
+
+    bool success = false;
+    if (!_preflight())
+    {
+        ESP_LOGE(TAG, "Update refused by the preflight check");
+    }
+    else
+    {
+        _selectMirror();
+        // the other images first, none of them is committed before the application image
+        success = _downloadTargets();
+        if (!success)
+        {
+            ESP_LOGE(TAG, "Update failed before the application image");
+        }
+        else if (_deltaBin.length() > 0)
+        {
+            // a patch that cannot be applied is no reason to skip the update
+            success = _performOTA(true);
+            if (!success && !_abortRequested)
+            {
+                ESP_LOGD(TAG, "Delta update failed, downloading the full image");
+                _otaWritten = 0;
+                _otaSize = 0;
+                success = _performOTA(false);
+            }
+        }
+        else
+        {
+            success = _performOTA(false);
+        }
+        success = _finishTargets(success);
+        if (!_abortRequested)
+        {
+            _saveMirror(success);
+        }
+    }
+
+    if (success)
+    {
+        if (_sink == &_updateSink)
+        {
+            _savePending();
+        }
+        _setState(OTA_DONE);
+    }
+    else
+    {
+        _setState(_abortRequested ? OTA_ABORTED : OTA_FAILED);
+    }
+
+    _metrics.totalMs = millis() - start;
+    if (_metricsCallback != NULL)
+    {
+        _metricsCallback(getMetrics());
+    }
+    return success;
+}
+
+// Parse "bytes <start>-<end>/<total>"
+static bool parseContentRange(const char *value, uint32_t &start, uint32_t &end, uint32_t &total)
+{
+    unsigned int first, last, size;
+    if (sscanf(value, "bytes %u-%u/%u", &first, &last, &size) != 3 || last < first)
+    {
+        return false;
+    }
+    start = first;
+    end = last;
+    total = size;
+    return true;
+}
+
+// Check a 206 response against the chunk that was asked for (first to last of an
+// image of total bytes). The server may send less than asked, never more, and
+// Content-Length must match the declared range.
+esp32FOTAGSM::RangeCheck esp32FOTAGSM::_checkRange(const HTTPResponse &range, uint32_t first, uint32_t last, uint32_t total)
+{
+    if (!range.hasRange)
+    {
+        ESP_LOGE(TAG, "Missing or invalid Content-Range");
+        return RANGE_RETRY;
+    }
+    if (range.rangeTotal != total)
+    {
+        ESP_LOGE(TAG, "Image size changed from %u to %u bytes", total, range.rangeTotal);
+        return RANGE_FATAL;
+    }
+    if (range.rangeStart != first || range.rangeEnd > last)
+    {
+        ESP_LOGE(TAG, "Got bytes %u-%u instead of %u-%u", range.rangeStart, range.rangeEnd, first, last);
+        return RANGE_RETRY;
+    }
+    if (range.contentLength >= 0 && (uint32_t)range.contentLength != range.rangeEnd - range.rangeStart + 1)
+    {
+        ESP_LOGE(TAG, "Content-Length %d does not match the Content-Range", range.contentLength);
+        return RANGE_RETRY;
+    }
+    return RANGE_OK;
+}
+
+// Whether a Content-Type value has the media type type, ignoring case and
+// parameters such as "; charset=utf-8"
+static bool mediaTypeIs(const char *contentType, const char *type)
+{
+    size_t length = strlen(type);
+    if (strncasecmp(contentType, type, length) != 0)
+    {
+        return false;
+    }
+    char next = contentType[length];
+    return next == 0 || next == ';' || next == ' ' || next == '\t';
+}
+
+// If line is the header name, return its value without leading spaces, else NULL
+static const char *matchHeader(const char *line, const char *name)
+{
+    size_t length = strlen(name);
+    if (strncasecmp(line, name, length) != 0 || line[length] != ':')
+    {
+        return NULL;
+    }
+
+    const char *value = line + length + 1;
+    while (*value == ' ' || *value == '\t')
+    {
+        value++;
+    }
+    return value;
+}
+
+// Start a request in the request buffer with the headers every request gets
+void esp32FOTAGSM::_requestBegin(const char *method, const String &host, const char *path)
+{
+    _requestLength = 0;
+    _requestOverflow = false;
+    _requestAppend("%s %s HTTP/1.1\r\nHost: %s\r\nCache-Control: no-cache\r\nUser-Agent: %s\r\n%s",
+                   method, path, host.c_str(), _userAgent.c_str(), _requestHeaders.c_str());
+}
+
+void esp32FOTAGSM::_requestAppend(const char *format, ...)
+{
+    if (_requestOverflow)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(_request + _requestLength, sizeof(_request) - _requestLength, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= sizeof(_request) - _requestLength)
+    {
+        _requestOverflow = true;
+        return;
+    }
+    _requestLength += n;
+}
+
+// End the headers and send the request in one write, false if it did not fit
+// the buffer or the client did not take it
+bool esp32FOTAGSM::_requestSend(bool keepAlive)
+{
+    _requestAppend("Connection: %s\r\n\r\n", keepAlive ? "keep-alive" : "close");
+    if (_requestOverflow)
+    {
+        ESP_LOGE(TAG, "Request is longer than %u bytes", sizeof(_request));
+        return false;
+    }
+    return _client->write((const uint8_t *)_request, _requestLength) == _requestLength;
+}
+
+// Read one line into line without the line end. Bytes that do not fit in size - 1
+// are dropped, which only ever cuts header values we do not need in full.
+// Returns the line length, or -1 if no data arrived within CLIENT_TIMEOUT_MS.
+int esp32FOTAGSM::_readLine(char *line, size_t size)
+{
+    size_t length = 0;
+
+    while (true)
+    {
+        int c = _client->read();
+        if (c < 0)
+        {
+            // the modem may still be receiving the rest of the headers
+            if (!_waitForData(CLIENT_TIMEOUT_MS))
+            {
+                line[length] = 0;
+                return -1;
+            }
+            continue;
+        }
+        if (c == '\n')
+        {
+            break;
+        }
+        if (c != '\r' && length < size - 1)
+        {
+            line[length++] = (char)c;
+        }
+    }
+
+    // remove trailing space
+    while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t'))
+    {
+        length--;
+    }
+    line[length] = 0;
+    return length;
+}
+
+// Read the status line and the headers of a response and leave the body unread.
+// The lines go through one fixed buffer, nothing is allocated.
+// Returns false if no complete header block was received.
+bool esp32FOTAGSM::_readResponseHeaders(HTTPResponse &response)
+{
+    char line[HEADER_LINE_SIZE];
+    const char *value;
+
+    response.status = 0;
+    response.contentLength = -1;
+    response.contentType[0] = 0;
+    response.contentEncoding[0] = 0;
+    response.acceptRanges = false;
+    response.keepAlive = true;
+    response.hasRange = false;
+    response.rangeStart = 0;
+    response.rangeEnd = 0;
+    response.rangeTotal = 0;
+    response.etag[0] = 0;
+    response.lastModified[0] = 0;
+    response.retryAfter = 0;
+
+    while (true)
+    {
+        int length = _readLine(line, sizeof(line));
+        if (length < 0)
+        {
+            ESP_LOGD(TAG, "Response headers incomplete");
+            return false;
+        }
+
+        ESP_LOGD(TAG, "Header line: %s", line);
+
+        if (length == 0)
+        {
+            // a blank line before the status line is skipped, after it the headers ended
+            if (response.status != 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (strncmp(line, "HTTP/1.", 7) == 0)
+        {
+            const char *code = strchr(line, ' ');
+            response.status = code != NULL ? atoi(code + 1) : 0;
+            // HTTP/1.0 closes the connection unless asked otherwise
+            response.keepAlive = line[7] != '0';
+            continue;
+        }
+
+        if (response.status == 0)
+        {
+            continue;
+        }
+
+        // extract headers here
+        if ((value = matchHeader(line, "Content-Length")) != NULL)
+        {
+            response.contentLength = atoi(value);
+            ESP_LOGD(TAG, "Content-Length: %d", response.contentLength);
+        }
+        else if ((value = matchHeader(line, "Content-type")) != NULL)
+        {
+            ESP_LOGD(TAG, "Content-type: %s", value);
+            snprintf(response.contentType, sizeof(response.contentType), "%s", value);
+        }
+        else if ((value = matchHeader(line, "Content-Encoding")) != NULL)
+        {
+            ESP_LOGD(TAG, "Content-Encoding: %s", value);
+            snprintf(response.contentEncoding, sizeof(response.contentEncoding), "%s", value);
+        }
+        else if ((value = matchHeader(line, "Accept-Ranges")) != NULL)
+        {
+            ESP_LOGD(TAG, "Accept-Ranges: %s", value);
+            response.acceptRanges = strcmp(value, "bytes") == 0;
+        }
+        else if ((value = matchHeader(line, "Connection")) != NULL)
+        {
+            if (strcasecmp(value, "keep-alive") == 0)
+            {
+                response.keepAlive = true;
+            }
+            else if (strcasecmp(value, "close") == 0)
+            {
+                response.keepAlive = false;
+            }
+        }
+        else if ((value = matchHeader(line, "Content-Range")) != NULL)
+        {
+            ESP_LOGD(TAG, "Content-Range: %s", value);
+            response.hasRange = parseContentRange(value, response.rangeStart, response.rangeEnd, response.rangeTotal);
+        }
+        // validators of the manifest and of a partial download
+        else if ((value = matchHeader(line, "ETag")) != NULL)
+        {
+            snprintf(response.etag, sizeof(response.etag), "%s", value);
+        }
+        else if ((value = matchHeader(line, "Last-Modified")) != NULL)
+        {
+            snprintf(response.lastModified, sizeof(response.lastModified), "%s", value);
+        }
+        // only the delay-seconds form, an HTTP date falls back to the backoff
+        else if ((value = matchHeader(line, "Retry-After")) != NULL)
+        {
+            response.retryAfter = strtoul(value, NULL, 10);
+        }
+    }
+
+    // An overloaded server sets the delay of the next retry or poll
+    if ((response.status == 429 || response.status == 503) && response.retryAfter > 0)
+    {
+        ESP_LOGD(TAG, "Server asks to retry after %u s", response.retryAfter);
+        _retryAfterMs = response.retryAfter * 1000UL;
+    }
+
+    _sessionUpdate(response);
+    return true;
+}
+
+// Download the list of block hashes of the bin, SHA-256_SIZE bytes per block
+bool esp32FOTAGSM::_fetchBlockHashes(uint8_t *&hashes, size_t &count)
+{
+    ESP_LOGD(TAG, "Fetching block hashes: %s", _blocksPath.c_str());
+
+    _blockingNetworkSemaphoreTake();
+    if (!_sessionConnect(_host, _port))
+    {
+        ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
+
+    _requestBegin("GET", _host, _blocksPath.c_str());
+
+    HTTPResponse response;
+    size_t received = 0;
+    hashes = NULL;
+    if (_requestSend(_keepAlive) && _waitForResponse() && _readResponseHeaders(response) && response.status == 200 &&
+        response.contentLength > 0 && response.contentLength <= BLOCK_LIST_MAX_SIZE &&
+        response.contentLength % SHA256_SIZE == 0)
+    {
+        hashes = (uint8_t *)malloc(response.contentLength);
+        if (hashes != NULL)
+        {
+            received = _readBody(hashes, response.contentLength);
+        }
+    }
+
+    bool complete = hashes != NULL && received == (size_t)response.contentLength;
+    if (!complete || !_keepAlive || !response.keepAlive)
+    {
+        _sessionClose();
+    }
+    _blockingNetworkSemaphoreGive();
+
+    if (!complete)
+    {
+        ESP_LOGE(TAG, "Could not get the block hashes");
+        free(hashes);
+        hashes = NULL;
+        return false;
+    }
+    count = received / SHA256_SIZE;
+    return true;
+}
+
+// Get the bin metadata with a separate HEAD request
+bool esp32FOTAGSM::_fetchHead(HTTPResponse &response)
+{
+    ESP_LOGD(TAG, "Connecting to: %s", _host.c_str());
+
+    _blockingNetworkSemaphoreTake();
+    // Connect to Webserver
+    if (!_sessionConnect(_host, _port))
+    {
+        ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
+
+    // Connection Succeed.
+    // Fetching the bin HEAD
+    ESP_LOGD(TAG, "Fetching Bin HEAD: %s", _downloadPath.c_str());
+
+    _requestBegin("HEAD", _host, _downloadPath.c_str());
+
+    bool gotResponse = false;
+    if (_requestSend(_keepAlive) && _waitForResponse())
+    {
+        gotResponse = _readResponseHeaders(response);
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Client Timeout !");
+    }
+
+    // Without keep-alive we will open a new connection to the server later
+    if (!gotResponse || !_keepAlive || !response.keepAlive)
+    {
+        _sessionClose();
+    }
+    _blockingNetworkSemaphoreGive();
+    return gotResponse;
+}
+
+// Get the bin metadata from the response to the first Range request instead of a
+// HEAD. On success the connection stays open with the payload unread and the
+// network semaphore held, so the response is used as the first chunk.
+bool esp32FOTAGSM::_fetchFirstRange(HTTPResponse &response)
+{
+    size_t firstChunk = _userBuffer != NULL ? _userBufferSize / _pipelineDepth : _poolBufferSize;
+    if (_chunkMin > 0 && _chunkMin < firstChunk)
+    {
+        firstChunk = _chunkMin;
+    }
+
+    ESP_LOGD(TAG, "Connecting to: %s", _host.c_str());
+
+    _blockingNetworkSemaphoreTake();
+    if (!_sessionConnect(_host, _port))
+    {
+        ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
+
+    // in streaming mode the whole image follows the headers
+    ESP_LOGD(TAG, "Fetching %s bytes of %s", _streaming ? "all" : String(firstChunk).c_str(), _downloadPath.c_str());
+
+    _requestBegin("GET", _host, _downloadPath.c_str());
+    if (_streaming)
+    {
+        _requestAppend("Range: bytes=0-\r\n");
+    }
+    else
+    {
+        _requestAppend("Range: bytes=0-%u\r\n", (unsigned)(firstChunk - 1));
+    }
+
+    if (!_requestSend(true) || !_waitForResponse() || !_readResponseHeaders(response))
+    {
+        ESP_LOGD(TAG, "Client Timeout !");
+        _sessionClose();
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
+    return true;
+}
+
+// OTA Logic
+// Download and flash _bin, or the patch _deltaBin when delta is set
+bool esp32FOTAGSM::_performOTA(bool delta)
+{
+    HTTPResponse response;
+    // the payload of the first response is waiting on the open connection
+    bool pending = false;
+    int contentLength = 0;
+    bool rangesSupported = false;
+    size_t total_written_bytes = 0;
+
+    _downloadPath = delta ? _deltaBin : _bin;
+    const String &manifestCompression = delta ? _deltaCompression : _compression;
+
+    if (_publicKey != NULL && _signature.length() == 0)
+    {
+        ESP_LOGE(TAG, "The image is not signed. Exiting OTA Update.");
+        return false;
+    }
+
+    // The block hashes describe the bin, not a patch
+    uint8_t *blockHashes = NULL;
+    size_t blockCount = 0;
+    if (!delta && _blocksPath.length() > 0 && _blockSize > 0 && !_fetchBlockHashes(blockHashes, blockCount))
+    {
+        ESP_LOGW(TAG, "No block hashes, the image is only checked once complete");
+    }
+
+    _client->setTimeout(CLIENT_TIMEOUT_MS);
+    ESP_LOGD(TAG, "timeout set to: %d", CLIENT_TIMEOUT_MS);
+
+    if (_skipHead)
+    {
+        if (!_fetchFirstRange(response))
+        {
+            free(blockHashes);
+            return false;
+        }
+        pending = true;
+    }
+    else if (!_fetchHead(response))
+    {
+        free(blockHashes);
+        return false;
+    }
+
+    if (pending && response.status == 206 && response.hasRange)
+    {
+        contentLength = response.rangeTotal;
+        rangesSupported = true;
+    }
+    else if (response.status == 200)
+    {
+        // a 200 to the first Range request carries the whole image
+        contentLength = response.contentLength;
+        rangesSupported = response.acceptRanges && !pending;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Got a %d status code from server. Exiting OTA Update.", response.status);
+        if (pending)
+        {
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+        }
+        free(blockHashes);
+        return false;
+    }
+
+    // A compressed image is announced by the manifest or by Content-Encoding
+    esp32FOTAGSMInflater::Format compression = esp32FOTAGSMInflater::formatFromName(manifestCompression.c_str());
+    if (compression == esp32FOTAGSMInflater::FORMAT_NONE)
+    {
+        compression = esp32FOTAGSMInflater::formatFromName(response.contentEncoding);
+    }
+
+    bool isValidContentType = mediaTypeIs(response.contentType, "application/octet-stream") ||
+                              (compression != esp32FOTAGSMInflater::FORMAT_NONE &&
+                               (mediaTypeIs(response.contentType, "application/gzip") ||
+                                mediaTypeIs(response.contentType, "application/x-gzip")));
+
+    // The manifest size is the size of the image as flashed, which for a compressed
+    // or patched download is only known once it is decoded
+    bool encoded = delta || compression != esp32FOTAGSMInflater::FORMAT_NONE;
+    size_t imageSize = contentLength;
+    bool sizeMatches = true;
+    if (encoded)
+    {
+        imageSize = _imageSize > 0 ? _imageSize : UPDATE_SIZE_UNKNOWN;
+    }
+    else if (_imageSize > 0 && (size_t)contentLength != _imageSize)
+    {
+        ESP_LOGE(TAG, "Server announced %d bytes but the manifest %u", contentLength, _imageSize);
+        sizeMatches = false;
+    }
+
+    // A staged download is stored as it arrives and only decoded and hashed
+    // when it is installed
+    bool staged = _stagingPartition != NULL;
+
+    // Hashing starts before _flashBegin(), which hashes the partial image of a
+    // resumed download
+    if (!staged && (_sha256.length() > 0 || _publicKey != NULL) && !_verifier.begin(_sha256.c_str()))
+    {
+        if (pending)
+        {
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+        }
+        free(blockHashes);
+        return false;
+    }
+
+    // check contentLength and content type
+    // Check if there is enough to OTA Update.
+    // Only plain ranged downloads can be resumed after a reboot, the
+    // decompressor and patch state cannot be checkpointed. A staged download
+    // is resumable whatever it contains.
+    const char *imageTag = response.etag[0] ? response.etag : response.lastModified;
+    bool began = false;
+    if (contentLength > 0 && isValidContentType && sizeMatches)
+    {
+        if (staged)
+        {
+            if (!rangesSupported)
+            {
+                _clearCheckpoint();
+            }
+            began = _resumeBegin(_stagingPartition, contentLength, imageTag);
+        }
+        else
+        {
+            began = _flashBegin(imageSize, _resumable && rangesSupported && !encoded, imageTag);
+        }
+    }
+    if (!began)
+    {
+        if (contentLength > 0 && isValidContentType && sizeMatches)
+        {
+            // not enough space to begin OTA
+            // Understand the partitions and
+            // space availability
+            ESP_LOGE(TAG, "Not enough space to begin OTA");
+        }
+        else
+        {
+            ESP_LOGE(TAG, "There was no content in the response or the content type was not application/octet-stream");
+        }
+        if (pending)
+        {
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+        }
+        _client->flush();
+        _verifier.release();
+        free(blockHashes);
+        return false;
+    }
+
+    // Block hashes are only of use when a corrupt block can be requested again
+    if (blockHashes != NULL && rangesSupported)
+    {
+        _verifier.setBlocks(_blockSize, contentLength, blockHashes, blockCount);
+    }
+    else
+    {
+        free(blockHashes);
+    }
+
+    if (!staged &&
+        ((delta && !_patcher.begin([this](uint8_t *data, size_t length)
+                                   { return _flashWrite(data, length); })) ||
+         (compression != esp32FOTAGSMInflater::FORMAT_NONE &&
+          !_inflater.begin(compression, [this](uint8_t *data, size_t length)
+                           { return _decodedWrite(data, length); }, _poolUsePSRAM))))
+    {
+        if (pending)
+        {
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+        }
+        _flashAbort();
+        return false;
+    }
+
+    ESP_LOGD(TAG, "OTA file can be downloaded.");
+    if (_inflater.isActive())
+    {
+        ESP_LOGD(TAG, "Image is compressed, it is decompressed while downloading");
+    }
+    if (_patcher.isActive())
+    {
+        ESP_LOGD(TAG, "Applying a patch against the running firmware");
+    }
+    // progress counts downloaded bytes, compressed or not
+    _otaSize = contentLength;
+    _setState(OTA_DOWNLOADING);
+
+    bool downloaded;
+    if (rangesSupported)
+    {
+        downloaded = _downloadRanged(contentLength, pending, response, total_written_bytes);
+    }
+    else
+    {
+        downloaded = _downloadFull(contentLength, pending, total_written_bytes);
+    }
+    if (!downloaded)
+    {
+        return false;
+    }
+
+    _setState(OTA_VERIFYING);
+
+    if (total_written_bytes == (size_t)contentLength)
+    {
+        ESP_LOGD(TAG, "Written: %d successfully", total_written_bytes);
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Written only : %d of %d. OTA will not proceed. ", total_written_bytes, contentLength);
+    }
+
+    if (staged)
+    {
+        return _installStaged(delta, compression, imageSize);
+    }
+    return _finishImage(encoded, total_written_bytes == (size_t)contentLength);
+}
+
+// Download the image in Range requests of the current chunk size. If pending, the
+// headers of the first response (first) have been read and its payload is next.
+bool esp32FOTAGSM::_downloadRanged(size_t contentLength, bool pending, const HTTPResponse &first, size_t &total_written_bytes)
+{
+    ESP_LOGD(TAG, "OTA file will be downloaded in chunks");
+
+    // The chunk buffers only live for the duration of the download
+    if (_poolAcquire(_pipelineDepth) == 0)
+    {
+        ESP_LOGE(TAG, "Not enough memory for the download buffer");
+        if (pending)
+        {
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+        }
+        _flashAbort();
+        return false;
+    }
+
+    // The chunk size adapts between the configured minimum and the buffer size
+    const uint max_chunk_size = _poolBufferSize;
+    const uint min_chunk_size = (_chunkMin > 0 && _chunkMin < max_chunk_size) ? _chunkMin : max_chunk_size;
+    _chunkSize = min_chunk_size;
+    _cleanChunks = 0;
+
+    // A resumed download starts at the last checkpoint
+    uint chunk_first_byte = _flashOffset;
+    uint chunk_last_byte = 0;
+    uint remainig_bytes = contentLength - _flashOffset;
+    uint8_t *chunk_buffer = _poolBuffers[0];
+    bool should_close_connection = !first.keepAlive;
+    size_t last_written_bytes = 0;
+    uint16_t retries = 0;
+    HTTPResponse response;
+
+    total_written_bytes = _flashOffset;
+
+    // In streaming mode one open-ended request carries the rest of the image,
+    // stream_remaining is what is left of its body
+    uint stream_remaining = 0;
+    bool stream_stale = false;
+
+    // The first response can only be used if it is the chunk we need next
+    uint pending_bytes = 0;
+    if (pending)
+    {
+        uint first_last_byte = _streaming ? contentLength - 1 : chunk_first_byte + max_chunk_size - 1;
+        if (_checkRange(first, chunk_first_byte, first_last_byte, contentLength) == RANGE_OK)
+        {
+            pending_bytes = first.rangeEnd - first.rangeStart + 1;
+            if (_streaming)
+            {
+                stream_remaining = pending_bytes;
+                pending_bytes = pending_bytes < _chunkSize ? pending_bytes : _chunkSize;
+            }
+        }
+        else
+        {
+            ESP_LOGD(TAG, "First response does not match the next chunk, requesting it again");
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+        }
+    }
+
+    // With more than one buffer, flash writes run in a separate task
+    // while the next chunk is received. A failed write is reported through
+    // _writerFailed on both paths.
+    _writerFailed = false;
+    bool pipelined = _poolCount > 1 && _startWriter();
+
+    uint8_t *buffer = NULL;
+
+    while (remainig_bytes > 0)
+    {
+        uint bytes_to_read;
+
+        // Pick a buffer the writer task is done with, before taking the modem
+        if (buffer == NULL)
+        {
+            buffer = pipelined ? _acquireBuffer() : chunk_buffer;
+        }
+
+        if (pending_bytes > 0)
+        {
+            // headers read and semaphore held by _fetchFirstRange()
+            bytes_to_read = pending_bytes;
+            pending_bytes = 0;
+        }
+        else
+        {
+            if (_abortRequested)
+            {
+                ESP_LOGE(TAG, "OTA aborted");
+                _sessionClose();
+                _abortDownload();
+                return false;
+            }
+
+            // a failed write is not retried: the bytes the sink or the decoder
+            // rejected would only be rejected again, and a patch that does not
+            // apply makes _runOTA() fall back to the full image
+            if (_writerFailed)
+            {
+                ESP_LOGE(TAG, "Flash write failed. Exiting OTA Update.");
+                _sessionClose();
+                _abortDownload();
+                return false;
+            }
+
+            if (!_waitForLink(min_chunk_size, max_chunk_size))
+            {
+                _sessionClose();
+                _abortDownload();
+                return false;
+            }
+
+            if (!_checkConnection())
+            {
+                ESP_LOGE(TAG, "Connection lost");
+                if (!_retryWait(retries))
+                {
+                    _abortDownload();
+                    return false;
+                }
+                continue;
+            }
+
+            _blockingNetworkSemaphoreTake();
+
+            // the rest of the stream follows data that was rejected
+            if (stream_stale)
+            {
+                _sessionClose();
+                stream_stale = false;
+            }
+
+            // check if the connection is still alive
+            if (!_client->connected())
+            {
+                stream_remaining = 0;
+                ESP_LOGE(TAG, "Client Disconnected");
+
+                // Connect to Webserver
+                if (_sessionConnect(_host, _port))
+                {
+                    ESP_LOGD(TAG, "client connected");
+                    _blockingNetworkSemaphoreGive();
+                }
+                else
+                {
+                    ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
+                    _blockingNetworkSemaphoreGive();
+                    if (!_retryWait(retries))
+                    {
+                        _abortDownload();
+                        return false;
+                    }
+                }
+                continue;
+            }
+
+            bytes_to_read = _chunkSize;
+            // end chunks on block boundaries, so a corrupt block is fetched again on its own
+            if (_verifier.hasBlocks())
+            {
+                uint block_end = (chunk_first_byte + bytes_to_read) / _verifier.blockSize() * _verifier.blockSize();
+                if (block_end > chunk_first_byte)
+                {
+                    bytes_to_read = block_end - chunk_first_byte;
+                }
+            }
+            if (remainig_bytes < bytes_to_read)
+            {
+                ESP_LOGW(TAG, "Last chunk of %d bytes", remainig_bytes);
+                bytes_to_read = remainig_bytes;
+            }
+
+            if (stream_remaining > 0)
+            {
+                // the open-ended response is still arriving, no request needed
+                if (bytes_to_read > stream_remaining)
+                {
+                    bytes_to_read = stream_remaining;
+                }
+            }
+            else
+            {
+                chunk_last_byte = _streaming ? contentLength - 1 : chunk_first_byte + bytes_to_read - 1;
+
+                ESP_LOGD(TAG, "Downloading %s from bytes %u to %u, remaining bytes: %u", _streaming ? "the rest" : "a chunk", chunk_first_byte, chunk_last_byte, remainig_bytes);
+
+                _client->flush();
+                // Get the contents of the bin file
+                _requestBegin("GET", _host, _downloadPath.c_str());
+                if (_streaming)
+                {
+                    _requestAppend("Range: bytes=%u-\r\n", chunk_first_byte);
+                }
+                else
+                {
+                    _requestAppend("Range: bytes=%u-%u\r\n", chunk_first_byte, chunk_last_byte);
+                }
+
+                // If there is no data to read, we will retry
+                if (!_requestSend(true) || !_waitForResponse())
+                {
+                    ESP_LOGD(TAG, "No data from server for %d ms", CLIENT_TIMEOUT_MS);
+                    ESP_LOGD(TAG, "Closing connection and retrying");
+                    _sessionClose();
+                    _blockingNetworkSemaphoreGive();
+                    _adaptChunkSize(false, min_chunk_size, max_chunk_size);
+                    if (!_retryWait(retries))
+                    {
+                        _abortDownload();
+                        return false;
+                    }
+                    continue;
+                }
+
+                // Read the headers
+                bool gotHeaders = _readResponseHeaders(response);
+
+                // A 200 means the Range header was ignored (e.g. by a proxy), asking
+                // again would only download the whole image again
+                if (gotHeaders && response.status == 200)
+                {
+                    ESP_LOGE(TAG, "Server ignored the Range request. Exiting OTA Update.");
+                    _sessionClose();
+                    _blockingNetworkSemaphoreGive();
+                    _abortDownload();
+                    return false;
+                }
+
+                RangeCheck rangeCheck = RANGE_RETRY;
+                if (!gotHeaders || response.status != 206)
+                {
+                    ESP_LOGE(TAG, "Got a %d status code from server instead of 206", response.status);
+                }
+                else
+                {
+                    rangeCheck = _checkRange(response, chunk_first_byte, chunk_last_byte, contentLength);
+                }
+
+                if (rangeCheck == RANGE_FATAL)
+                {
+                    _sessionClose();
+                    _blockingNetworkSemaphoreGive();
+                    _abortDownload();
+                    return false;
+                }
+                if (rangeCheck == RANGE_RETRY)
+                {
+                    // the body is not what we asked for, drop it with the connection
+                    ESP_LOGE(TAG, "Retrying the chunk");
+                    _sessionClose();
+                    _blockingNetworkSemaphoreGive();
+                    if (!_retryWait(retries))
+                    {
+                        _abortDownload();
+                        return false;
+                    }
+                    continue;
+                }
+                ESP_LOGV(TAG, "Headers ended. Get the payload");
+
+                // read exactly the declared bytes, the server may send less than asked
+                if (_streaming)
+                {
+                    stream_remaining = response.rangeEnd - response.rangeStart + 1;
+                    if (bytes_to_read > stream_remaining)
+                    {
+                        bytes_to_read = stream_remaining;
+                    }
+                }
+                else
+                {
+                    bytes_to_read = response.rangeEnd - response.rangeStart + 1;
+                }
+                should_close_connection = !response.keepAlive;
+            }
+        }
+
+        // Read the payload
+        unsigned long receive_start = millis();
+        size_t readed_bytes = _readBody(buffer, bytes_to_read);
+        _metrics.receiveMs += millis() - receive_start;
+        ESP_LOGD(TAG, "Readed %u bytes from payload", readed_bytes);
+
+        // Check if the readed bytes are same as the expected bytes
+        if (readed_bytes != bytes_to_read)
+        {
+            ESP_LOGE(TAG, "Expected %u bytes but got %u", bytes_to_read, readed_bytes);
+            _metrics.shortReads++;
+        }
+        _adaptChunkSize(readed_bytes == bytes_to_read, min_chunk_size, max_chunk_size);
+
+        if (stream_remaining > 0)
+        {
+            // a short read ends the stream, it is requested again from the next offset
+            stream_remaining = readed_bytes == bytes_to_read ? stream_remaining - readed_bytes : 0;
+        }
+
+        if (should_close_connection && stream_remaining == 0)
+        {
+            ESP_LOGD(TAG, "Server will close the connection, so we will stop the client to reconnect again later");
+            _sessionClose();
+        }
+        else if (readed_bytes != bytes_to_read)
+        {
+            // the rest of this response may still arrive and would be taken for
+            // the headers of the next one
+            ESP_LOGD(TAG, "Closing the connection after a short read");
+            _sessionClose();
+        }
+
+        // The modem is free while the chunk goes to flash
+        _blockingNetworkSemaphoreGive();
+
+        // Nothing of a chunk with a corrupt block is written, it is requested again
+        esp32FOTAGSMVerifier::BlockCheck blockCheck = _verifier.checkBlocks(chunk_first_byte, buffer, readed_bytes);
+        if (blockCheck != esp32FOTAGSMVerifier::BLOCK_OK)
+        {
+            stream_stale = stream_remaining > 0;
+            stream_remaining = 0;
+            if (blockCheck == esp32FOTAGSMVerifier::BLOCK_FATAL || !_retryWait(retries))
+            {
+                _abortDownload();
+                return false;
+            }
+            continue;
+        }
+
+        if (pipelined)
+        {
+            // Hand the chunk to the writer task, a failed write is
+            // reported through _writerFailed
+            _submitBuffer(buffer, readed_bytes);
+            buffer = NULL;
+            last_written_bytes = readed_bytes;
+        }
+        else
+        {
+            // Write chunk to flash
+            last_written_bytes = _imageWrite(chunk_buffer, readed_bytes);
+            total_written_bytes += last_written_bytes;
+
+            // Check if the written bytes are same as the expected bytes
+            if (last_written_bytes != readed_bytes)
+            {
+                ESP_LOGE(TAG, "Expected to write %u bytes but %u were written", readed_bytes, last_written_bytes);
+                _writerFailed = true;
+            }else{
+                ESP_LOGD(TAG, "Written %u bytes to flash", total_written_bytes);
+            }
+        }
+
+        if (last_written_bytes > 0)
+        {
+            retries = 0;
+        }
+
+        chunk_first_byte += last_written_bytes;
+        remainig_bytes -= last_written_bytes;
+
+        ESP_LOGD(TAG, "next chunk of %u bytes from byte %u, remaining bytes: %u", _chunkSize, chunk_first_byte, remainig_bytes);
+
+        if (should_close_connection && stream_remaining == 0)
+        {
+            // give the modem time to close the socket
+            _idleWait(1000, _abortRequested, false);
+        }
+        _networkYield();
+    }
+
+    // Wait for the last chunks to reach the flash
+    bool writerOk = _stopWriter() && !_writerFailed;
+    if (pipelined)
+    {
+        total_written_bytes += _writerWritten;
+    }
+    _poolRelease();
+    if (!writerOk)
+    {
+        ESP_LOGE(TAG, "Flash write failed. Exiting OTA Update.");
+        _flashAbort();
+        return false;
     }
+    return true;
 }
 
-void esp32FOTAGSM::_blockingNetworkSemaphoreGive()
+// Read contentLength body bytes from the client into _imageWrite(). Returns the
+// number of bytes used.
+size_t esp32FOTAGSM::_streamToImage(size_t contentLength)
 {
-    if (_networkSemaphore != NULL)
+    size_t total = 0;
+
+    if (_poolAcquire(1) == 0)
     {
-        ESP_LOGD(TAG, "Giving network semaphore");
-        xSemaphoreGive(_networkSemaphore);
-    }else{
-        ESP_LOGD(TAG, "No network semaphore");
+        ESP_LOGE(TAG, "Not enough memory for the download buffer");
+        return 0;
     }
-}
 
-static void splitHeader(String src, String &header, String &headerValue)
-{
-    int idx = 0;
+    while (total < contentLength)
+    {
+        unsigned long start = millis();
+        if (_abortRequested || !_waitForData(CLIENT_TIMEOUT_MS))
+        {
+            break;
+        }
 
-    idx = src.indexOf(':');
-    header = src.substring(0, idx);
-    headerValue = src.substring(idx + 1, src.length());
-    headerValue.trim();
+        size_t length = contentLength - total;
+        if (length > _poolBufferSize)
+        {
+            length = _poolBufferSize;
+        }
+        int received = _client->read(_poolBuffers[0], length);
+        _metrics.receiveMs += millis() - start;
+        if (received <= 0)
+        {
+            continue;
+        }
+        _metrics.bytesReceived += received;
+        if (_imageWrite(_poolBuffers[0], received) != (size_t)received)
+        {
+            break;
+        }
+        total += received;
+    }
 
-    return;
+    _poolRelease();
+    return total;
 }
 
-// OTA Logic
-bool esp32FOTAGSM::execOTA()
+// Read length body bytes into buffer, as many as the client has at a time.
+// Returns fewer if the data stops for CLIENT_TIMEOUT_MS, the connection closes
+// or the OTA is aborted.
+size_t esp32FOTAGSM::_readBody(uint8_t *buffer, size_t length)
 {
-    unsigned long timeout = 0;
-    int contentLength = 0;
-    bool isValidContentType = false;
-    bool Accept_Ranges_bytes = false;
-    bool gotHTTPStatus = false;
+    size_t total = 0;
 
-    size_t total_written_bytes = 0;
-    size_t last_written_bytes = 0;
+    while (total < length)
+    {
+        if (_abortRequested || !_waitForData(CLIENT_TIMEOUT_MS))
+        {
+            break;
+        }
+        int received = _client->read(buffer + total, length - total);
+        if (received > 0)
+        {
+            total += received;
+        }
+    }
 
-    ESP_LOGD(TAG, "Connecting to: %S", _host.c_str());
+    _metrics.bytesReceived += total;
+    return total;
+}
 
-    _client->setTimeout(CLIENT_TIMEOUT_MS);
-    ESP_LOGD(TAG, "timeout set to: %d", CLIENT_TIMEOUT_MS);
+// Download the image with a single GET. If pending, the headers of the response
+// have been read and the image body is next on the connection.
+bool esp32FOTAGSM::_downloadFull(size_t contentLength, bool pending, size_t &total_written_bytes)
+{
+    ESP_LOGD(TAG, "OTA file will be downloaded in one go");
 
-    _blockingNetworkSemaphoreTake();
-    // Connect to Webserver
-    if (_client->connect(_host.c_str(), _port))
+    if (!pending)
     {
+        _blockingNetworkSemaphoreTake();
+        _client->flush();
 
-        // Connection Succeed.
-        // Fetching the bin HEAD
-        ESP_LOGD(TAG, "Fetching Bin HEAD: %s", _bin.c_str());
+        // Connect to Webserver
+        if (!_sessionConnect(_host, _port))
+        {
+            ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
+            _blockingNetworkSemaphoreGive();
+            _flashAbort();
+            return false;
+        }
 
         // Get the contents of the bin file
-        _client->print(String("HEAD ") + _bin + " HTTP/1.1\r\n" +
-                       "Host: " + _host + "\r\n" +
-                       "Cache-Control: no-cache\r\n" +
-                       "Connection: close\r\n\r\n");
+        _requestBegin("GET", _host, _downloadPath.c_str());
 
-        timeout = millis();
-        while (_client->available() == 0)
+        HTTPResponse response;
+        if (!_requestSend(false) || !_waitForResponse() || !_readResponseHeaders(response) || response.status != 200)
         {
-            if (millis() - timeout > CLIENT_TIMEOUT_MS)
-            {
-                ESP_LOGD(TAG, "Client Timeout !");
-                _client->stop();
-                _blockingNetworkSemaphoreGive();
-                return false;
-            }
+            ESP_LOGD(TAG, "No valid response from the server");
+            _sessionClose();
+            _blockingNetworkSemaphoreGive();
+            _flashAbort();
+            return false;
         }
+        ESP_LOGD(TAG, "Headers ended. Get the OTA started");
+    }
 
-        while (_client->available())
-        {
-            String header, headerValue;
-            // read line till /n
-            String line = _client->readStringUntil('\n');
+    ESP_LOGD(TAG, "Begin OTA. This may take several minutes to complete. Patience!");
+    total_written_bytes = _streamToImage(contentLength);
 
-            ESP_LOGD(TAG, "Header line: %s", line.c_str());
+    _sessionClose();
+    _blockingNetworkSemaphoreGive();
+    if (total_written_bytes != contentLength)
+    {
+        ESP_LOGE(TAG, "Body ended after %u of %u bytes", total_written_bytes, contentLength);
+        _flashAbort();
+        return false;
+    }
+    return true;
+}
 
-            // remove space, to check if the line is end of headers
-            line.trim();
+// The body of the manifest response, at most length bytes of the client.
+// ArduinoJson reads it one entry at a time.
+class ManifestStream : public Stream
+{
+public:
+    ManifestStream(Client &client, size_t length) : _client(client), _remaining(length)
+    {
+        setTimeout(MANIFEST_TIMEOUT_MS);
+    }
 
-            if (!line.length())
-            {
-                //headers ended
-                break; // and get the OTA started
-            }
+    int available()
+    {
+        int n = _client.available();
+        return (size_t)n > _remaining ? _remaining : n;
+    }
 
-            // Check if the HTTP Response is 200
-            // else break and Exit Update
-            if (line.startsWith("HTTP/1.1"))
-            {
-                if (line.indexOf("200") < 0)
-                {
-                    ESP_LOGE(TAG, "Got a non 200 status code from server. Exiting OTA Update.");
-                    _client->stop();
-                    break;
-                }
-                gotHTTPStatus = true;
-            }
+    int read()
+    {
+        if (_remaining == 0)
+        {
+            return -1;
+        }
+        int c = _client.read();
+        if (c >= 0)
+        {
+            _remaining--;
+        }
+        return c;
+    }
 
-            if (false == gotHTTPStatus)
-            {
-                continue;
-            }
+    int peek()
+    {
+        return _remaining == 0 ? -1 : _client.peek();
+    }
 
-            splitHeader(line, header, headerValue);
+    size_t write(uint8_t)
+    {
+        return 0;
+    }
 
-            // extract headers here
-            // Content-Length
-            if (header.equalsIgnoreCase("Content-Length"))
-            {
-                contentLength = headerValue.toInt();
-                ESP_LOGD(TAG, "Content-Length: %d", contentLength);
-            }
-            // Content-type
-            else if (header.equalsIgnoreCase("Content-type"))
-            {
-                String contentType = headerValue;
-                ESP_LOGD(TAG, "Content-type: %s", contentType.c_str());
-                if (contentType == "application/octet-stream")
-                {
-                    ESP_LOGD(TAG, "Valid Content-type");
-                    isValidContentType = true;
-                }
-            }
-            // Accept-Ranges
-            else if (header.equalsIgnoreCase("Accept-Ranges"))
+    // Skip whitespace, return the next character without reading it or -1
+    int skipSpace()
+    {
+        while (_remaining > 0)
+        {
+            int c = timedPeek();
+            if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
             {
-                String contentType = headerValue;
-                ESP_LOGD(TAG, "Accept-Ranges: %s", contentType.c_str());
-                if (contentType == "bytes")
-                {
-                    ESP_LOGD(TAG, "Server supports range requests");
-                    Accept_Ranges_bytes = true;
-                }
+                return c;
             }
+            read();
         }
+        return -1;
     }
-    else
+
+    // Read the rest of the body, true if all of it arrived
+    bool drain()
     {
-        ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
-        _blockingNetworkSemaphoreGive();
-        return false;
+        while (_remaining > 0 && timedRead() >= 0)
+        {
+        }
+        return _remaining == 0;
     }
 
-    // We will open a new connection to the server later
-    _client->stop();
-    _blockingNetworkSemaphoreGive();
+private:
+    Client &_client;
+    size_t _remaining;
+};
 
-    // check contentLength and content type
-    if (contentLength && isValidContentType)
+// Version of a manifest entry if this device should install it, else -1.
+// An entry applies to one firmware type, optionally only to running versions
+// between minVersion and maxVersion and to rollout percent of the devices.
+static int manifestEntryVersion(JsonObject entry, const String &type, int version, const String &deviceID)
+{
+    int entryVersion = entry["version"] | -1;
+    int rollout = entry["rollout"] | 100;
+
+    if (type != (entry["type"] | "") || entryVersion <= version ||
+        version < (entry["minVersion"] | 0) || version > (entry["maxVersion"] | version))
     {
+        return -1;
+    }
 
-        // Check if there is enough to OTA Update.
-        if (Update.begin(contentLength))
+    if (rollout < 100)
+    {
+        // FNV-1a of the device and the version: a device stays in or out of the
+        // rollout of a version while the percentage grows
+        uint32_t hash = 2166136261u;
+        String key = deviceID + ":" + String(entryVersion);
+        for (size_t i = 0; i < key.length(); i++)
+        {
+            hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+        }
+        if ((int)(hash % 100) >= rollout)
         {
-            ESP_LOGD(TAG, "OTA file can be downloaded.");
+            ESP_LOGD(TAG, "Version %d is not rolled out to this device yet", entryVersion);
+            return -1;
+        }
+    }
+    return entryVersion;
+}
 
-            if (_checksum.length() > 0)
+// The patch of a "delta" object or list that applies to the running version
+static JsonObject manifestDelta(JsonVariant delta, int version)
+{
+    if (delta.is<JsonArray>())
+    {
+        for (JsonVariant patch : delta.as<JsonArray>())
+        {
+            if ((patch["from"] | -1) == version)
             {
-                ESP_LOGD(TAG, "Checksum: %s", _checksum.c_str());
-                Update.setMD5(_checksum.c_str());
-            }else{
-                ESP_LOGD(TAG, "No checksum provided");
+                return patch.as<JsonObject>();
             }
+        }
+    }
+    else if ((delta["from"] | -1) == version)
+    {
+        return delta.as<JsonObject>();
+    }
+    return JsonObject();
+}
 
-            // Setup Update onProgress callback
-            Update.onProgress(
-                [](unsigned int progress, unsigned int total)
-                {
-                    ESP_LOGI(TAG, "Update Progress: %u of %u", progress, total);
-                });
+bool esp32FOTAGSM::execHTTPcheck()
+{
+    String useURL;
 
-            if (Accept_Ranges_bytes)
-            {
-                ESP_LOGD(TAG, "OTA file will be downloaded in chunks");
+    // cleared by _finishCheck() once the server gave an answer
+    _checkFailed = true;
+    // a check starts the metrics over, they would add to the last update's
+    _metrics = OTAMetrics();
 
-                // Number of chunks
-                int numChunks = contentLength / DOWNLOAD_CHUNK_SIZE;
-                if (contentLength % DOWNLOAD_CHUNK_SIZE)
-                {
-                    numChunks++;
-                }
+    // the query lets the server or a CDN answer for this device or version
+    useURL = checkRESOURCE;
+    char separator = checkRESOURCE.indexOf('?') < 0 ? '?' : '&';
+    if (useDeviceID)
+    {
+        useURL += separator;
+        useURL += "id=" + _getDeviceID();
+        separator = '&';
+    }
+    if (useVersion)
+    {
+        useURL += separator;
+        useURL += "version=" + String(_firwmareVersion);
+    }
 
-                uint chunk_first_byte = 0;
-                uint chunk_last_byte = DOWNLOAD_CHUNK_SIZE - 1;
-                uint remainig_bytes = contentLength;
-                uint8_t chunk_buffer[DOWNLOAD_CHUNK_SIZE + 1];
-                bool should_close_connection = false;
+    ESP_LOGD(TAG, "Getting %s", useURL.c_str());
 
-                while (remainig_bytes > 0)
-                {
-                    if (!_checkConnection())
-                    {
-                        ESP_LOGE(TAG, "Connection lost. Retrying in 5 seconds");
-                        delay(5000);
-                        continue;
-                    }
+    //current connection status should be checked before calling this function
 
-                    _blockingNetworkSemaphoreTake();
+    _client->setTimeout(CLIENT_TIMEOUT_MS);
 
-                    // check if the connection is still alive
-                    if (!_client->connected())
-                    {
-                        ESP_LOGE(TAG, "Client Disconnected");
-
-                        // Connect to Webserver
-                        if (_client->connect(_host.c_str(), _port))
-                        {
-                            ESP_LOGD(TAG, "client connected");
-                            _blockingNetworkSemaphoreGive();
-                        }
-                        else
-                        {
-                            ESP_LOGD(TAG, "Connection to %s failed! Retrying in 5 seconds", _host.c_str());
-                            _blockingNetworkSemaphoreGive();
-                            delay(5000);
-                            continue;
-                        }
-                    }
-                    else
-                    {
+    _blockingNetworkSemaphoreTake();
+    if (!_sessionConnect(checkHOST, checkPORT))
+    {
+        // Connect to webserver failed
+        ESP_LOGD(TAG, "Connection to %s failed.", checkHOST.c_str());
 
-                        if (remainig_bytes < DOWNLOAD_CHUNK_SIZE)
-                        {
-                            ESP_LOGW(TAG, "Last chunk of %d bytes", remainig_bytes);
-                            chunk_last_byte = chunk_first_byte + remainig_bytes - 1;
-                        }
-
-                        if( chunk_last_byte - chunk_first_byte > DOWNLOAD_CHUNK_SIZE)
-                        {
-                            ESP_LOGW(TAG, "Chunk size is too big, adjust to DOWNLOAD_CHUNK_SIZE");
-                            chunk_last_byte = chunk_first_byte + DOWNLOAD_CHUNK_SIZE - 1;
-                        }
-
-                        ESP_LOGD(TAG, "Downloading a chunk from bytes %u to %u, remaining bytes: %u", chunk_first_byte, chunk_last_byte, remainig_bytes);
-
-                        _client->flush();
-                        // Get the contents of the bin file
-                        _client->print(String("GET ") + _bin + " HTTP/1.1\r\n" +
-                                       "Host: " + _host + "\r\n" +
-                                       "Cache-Control: no-cache\r\n" +
-                                       "Range: bytes=" + String(chunk_first_byte) + "-" + String(chunk_last_byte) + "\r\n" +
-                                       "Connection: keep-alive\r\n\r\n");
-
-                        timeout = millis();
-                        while (_client->available() == 0)
-                        {
-                            if (millis() - timeout > CLIENT_TIMEOUT_MS)
-                            {
-                                ESP_LOGD(TAG, "No data from server for %d ms", CLIENT_TIMEOUT_MS);
-                                break;
-                            }
-                        }
-                        // At this point we should have data to read, if not, we will retry
-                        if(_client->available() == 0)
-                        {
-                            ESP_LOGD(TAG, "Closing connection and waiting 5s to reconnect");
-                            _client->stop();
-                            _blockingNetworkSemaphoreGive();
-                            delay(5000);
-                            continue;
-                        }
-
-                        // Read the headers
-                        while (_client->available())
-                        {
-                            String header, headerValue;
-                            // read line till /n
-                            String line = _client->readStringUntil('\n');
-
-                            // ESP_LOGV(TAG, "Header line: %s", line.c_str());
-
-                            // remove space, to check if the line is end of headers
-                            line.trim();
-
-                            if (!line.length())
-                            {
-                                ESP_LOGV(TAG, "Headers ended. Get the payload");
-                                break;
-                            }
-                            // Check if the HTTP Response is 206
-                            // else break and Exit Update
-                            if (line.startsWith("HTTP/1.1"))
-                            {
-                                if (line.indexOf("206") < 0)
-                                {
-                                    ESP_LOGE(TAG, "Got a non 206 status code from server. Exiting OTA Update.");
-                                    // @TODO: check exit code
-                                    _client->stop();
-                                    break;
-                                }
-                            }
-
-                            splitHeader(line, header, headerValue);
-
-                            // extract headers here
-                            // Connection
-                            if (header.equalsIgnoreCase("Connection"))
-                            {
-                                if (headerValue == "keep-alive")
-                                {
-                                    ESP_LOGD(TAG, "Server will keep the connection alive");
-                                    should_close_connection = false;
-                                }
-                                else
-                                {
-                                    ESP_LOGD(TAG, "Server will close the connection");
-                                    should_close_connection = true;
-                                }
-                            }
-                            // Content-Range
-                            else if (header.equalsIgnoreCase("Content-Range"))
-                            {
-                                ESP_LOGD(TAG, "Content-Range: %s", headerValue.c_str());
-                                // @TODO: check if the content range is valid
-                            }
-                        }
-
-                        uint bytes_to_read = chunk_last_byte - chunk_first_byte + 1;
-
-                        // Read the payload
-                        size_t readed_bytes = _client->readBytes(chunk_buffer, bytes_to_read);
-                        ESP_LOGD(TAG, "Readed %u bytes from payload", readed_bytes);
-
-                        // Check if the readed bytes are same as the expected bytes
-                        if (readed_bytes != bytes_to_read)
-                        {
-                            ESP_LOGE(TAG, "Expected %u bytes but got %u", bytes_to_read, readed_bytes);
-                            
-                            // We readed less than expected, so we update the chunk_last_byte acordingly
-                            chunk_last_byte = chunk_first_byte + readed_bytes - 1;
-                        }
-
-                        // Write chunk to flash
-                        last_written_bytes = Update.write(chunk_buffer, readed_bytes);
-                        total_written_bytes += last_written_bytes;
-
-                        // Check if the written bytes are same as the expected bytes
-                        if (last_written_bytes != readed_bytes)
-                        {
-                            ESP_LOGE(TAG, "Expected to write %u bytes but %u were written", readed_bytes, total_written_bytes);
-                        }else{
-                            ESP_LOGD(TAG, "Written %u bytes to flash", total_written_bytes);
-                        }
-
-                        chunk_first_byte += last_written_bytes;
-                        chunk_last_byte += last_written_bytes;
-                        remainig_bytes -= last_written_bytes;
-
-                        ESP_LOGD(TAG, "next chunk from bytes %u to %u, remaining bytes: %u", chunk_first_byte, chunk_last_byte, remainig_bytes);
-
-                        if (should_close_connection)
-                        {
-                            ESP_LOGD(TAG, "Server will close the connection, so we will stop the client to reconnect again later");
-                            _client->stop();
-                            delay(1000);
-                        }
-                        _blockingNetworkSemaphoreGive();
-                        delay(250); //give some time for other threads to take the semaphore
-                    }
-                }
-            }
-            else
-            {
-                ESP_LOGD(TAG, "OTA file will be downloaded in one go");
-                _blockingNetworkSemaphoreTake();
-                _client->flush();
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
 
-                // Connect to Webserver
-                if (_client->connect(_host.c_str(), _port))
-                {
-                    // Get the contents of the bin file
-                    _client->print(String("GET ") + _bin + " HTTP/1.1\r\n" +
-                                   "Host: " + _host + "\r\n" +
-                                   "Cache-Control: no-cache\r\n" +
-                                   "Connection: close\r\n\r\n");
-
-                    timeout = millis();
-                    while (_client->available() == 0)
-                    {
-                        if (millis() - timeout > CLIENT_TIMEOUT_MS)
-                        {
-                            ESP_LOGD(TAG, "Client Timeout !");
-                            _client->stop();
-                            _blockingNetworkSemaphoreGive();
-                            return false;
-                        }
-                    }
-                    while (_client->available())
-                    {
-                        String header, headerValue;
-                        // read line till /n
-                        String line = _client->readStringUntil('\n');
+    // Connection Succeed.
 
-                        ESP_LOGD(TAG, "Header line: %s", line.c_str());
+    // Only ask for the manifest if it changed since the last check
+    _loadManifestCache();
+    String report;
+    _loadRollbackState(report);
+    _requestBegin("GET", checkHOST, useURL.c_str());
+    if (report.length() > 0)
+    {
+        // the outcome of the last update goes with the next check
+        _requestAppend("X-OTA-Result: %s\r\n", report.c_str());
+    }
+    if (_manifestETag.length() > 0)
+    {
+        _requestAppend("If-None-Match: %s\r\n", _manifestETag.c_str());
+    }
+    if (_manifestLastModified.length() > 0)
+    {
+        _requestAppend("If-Modified-Since: %s\r\n", _manifestLastModified.c_str());
+    }
 
-                        // remove space, to check if the line is end of headers
-                        line.trim();
+    HTTPResponse response;
+    if (!_requestSend(_keepAlive) || !_waitForResponse() || !_readResponseHeaders(response))
+    {
+        ESP_LOGD(TAG, "Client Timeout !");
+        _sessionClose();
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
+    if (report.length() > 0)
+    {
+        _clearReport();
+    }
 
-                        if (!line.length())
-                        {
-                            ESP_LOGD(TAG, "Headers ended. Get the OTA started");
-                            break;
-                        }
-                    }
+    // Nothing changed, the result of the last check still holds
+    if (response.status == 304)
+    {
+        ESP_LOGD(TAG, "Manifest not modified");
+        _blockingNetworkSemaphoreGive();
+        return _finishCheck(_manifestUpdate, response.keepAlive);
+    }
 
-                    ESP_LOGD(TAG, "Begin OTA. This may take several minutes to complete. Patience!");
-                    total_written_bytes = Update.writeStream(*_client);
-                }
-                else
-                {
-                    ESP_LOGD(TAG, "Connection to %s failed!", _host.c_str());
-                    _blockingNetworkSemaphoreGive();
-                    return false;
-                }
-            }
-            _blockingNetworkSemaphoreGive();
+    // Check if the HTTP Response is 200
+    if (response.status != 200)
+    {
+        ESP_LOGD(TAG, "Got a %d status code from server. Exiting OTA Update.", response.status);
+        _sessionClose();
+        _blockingNetworkSemaphoreGive();
+        return false;
+    }
 
-            if (total_written_bytes == contentLength)
-            {
-                ESP_LOGD(TAG, "Written: %d successfully", total_written_bytes);
-            }
-            else
-            {
-                ESP_LOGD(TAG, "Written only : %d of %d. OTA will not proceed. ", total_written_bytes, contentLength);
-            }
+    int contentLength = response.contentLength;
+    bool isValidContentType = mediaTypeIs(response.contentType, "application/json");
+
+    // check contentLength and content type
+    if (contentLength <= 0 || !isValidContentType)
+    {
+        ESP_LOGD(TAG, "There was no content in the response");
+        _client->flush();
+
+        _sessionClose();
+        _blockingNetworkSemaphoreGive();
+
+        return false;
+    }
+
+    // Only the fields used below are kept from each entry
+    StaticJsonDocument<384> filter;
+    const char *fields[] = {"type", "version", "minVersion", "maxVersion", "host", "port", "mirrors", "bin",
+                            "checksum", "targets", "size", "compression", "rollout", "delta",
+                            "sha256", "signature", "blocks", "blockSize"};
+    for (const char *field : fields)
+    {
+        filter[field] = true;
+    }
+
+    // The manifest is a single entry or an array of entries, parsed one entry at a time
+    ManifestStream stream(*_client, contentLength);
+    StaticJsonDocument<MANIFEST_ENTRY_SIZE> JSONDocument; //Memory pool
+    String deviceID = _getDeviceID();
+    bool isArray = stream.skipSpace() == '[';
+    bool parsed = true;
+    int entries = 0;
+    int plversion = -1;
+
+    if (isArray)
+    {
+        stream.read();
+    }
+    while (parsed)
+    {
+        if (isArray && stream.skipSpace() == ']')
+        {
+            break;
+        }
 
-            if (Update.end())
+        DeserializationError err = deserializeJson(JSONDocument, stream, DeserializationOption::Filter(filter));
+        if (err)
+        { //Check for errors in parsing
+            ESP_LOGD(TAG, "Parsing failed: %s", err.c_str());
+            parsed = false;
+            break;
+        }
+        entries++;
+
+        int entryVersion = manifestEntryVersion(JSONDocument.as<JsonObject>(), _firwmareType, _firwmareVersion, deviceID);
+        if (entryVersion >= 0 && entryVersion == _rejectedVersion)
+        {
+            ESP_LOGD(TAG, "Skipping version %d, it was rolled back", entryVersion);
+            entryVersion = -1;
+        }
+        if (entryVersion > plversion)
+        {
+            // the newest applicable entry wins, the first one for equal versions
+            plversion = entryVersion;
+            _host = String(JSONDocument["host"] | "");
+            // same port as the manifest server unless given, 443 with TLS
+            _port = JSONDocument["port"] | checkPORT;
+            // optional, more servers with the same files: "mirrors": [{"host": "cdn.example.com", "port": 443}]
+            _mirrorHosts[0] = _host;
+            _mirrorPorts[0] = _port;
+            _mirrorCount = 1;
+            for (JsonVariant mirror : JSONDocument["mirrors"].as<JsonArray>())
             {
-                ESP_LOGD(TAG, "OTA done!");
-                if (Update.isFinished())
-                {
-                    ESP_LOGD(TAG, "Update MD5: %s", Update.md5String().c_str());
-                    ESP_LOGD(TAG, "Update successfully completed. Rebooting.");
-                    ESP.restart();
-                }
-                else
+                String mirrorHost = mirror["host"] | "";
+                if (mirrorHost.length() > 0 && _mirrorCount < MAX_MIRRORS)
                 {
-                    ESP_LOGD(TAG, "Update not finished? Something went wrong!");
+                    _mirrorHosts[_mirrorCount] = mirrorHost;
+                    _mirrorPorts[_mirrorCount] = mirror["port"] | _port;
+                    _mirrorCount++;
                 }
             }
-            else
+            _bin = String(JSONDocument["bin"] | "");
+            // optional, more images by target name, from the same servers:
+            // "targets": {"stm32": {"bin": "/fota/stm32_2.bin", "checksum": "...", "size": 65536}}
+            for (uint8_t i = 0; i < _targetCount; i++)
             {
-                ESP_LOGD(TAG, "Error Occurred. Error #%d: %s", Update.getError(), Update.errorString());
+                JsonObject target = JSONDocument["targets"][_targets[i].name.c_str()];
+                _targets[i].bin = String(target["bin"] | "");
+                _targets[i].checksum = String(target["checksum"] | "");
+                _targets[i].size = target["size"] | 0;
             }
+            _checksum = String(JSONDocument["checksum"] | "");
+            // optional, checked against the size the server reports
+            _imageSize = JSONDocument["size"] | 0;
+            // optional, "gzip" or "deflate" for a compressed bin
+            _compression = JSONDocument["compression"] | "";
+
+            // optional, one or a list of patches: "delta": {"from": 1, "bin": "/fw_1_2.patch"}
+            JsonObject delta = manifestDelta(JSONDocument["delta"], _firwmareVersion);
+            _deltaBin = delta.isNull() ? "" : String(delta["bin"] | "");
+            _deltaCompression = delta.isNull() ? "" : String(delta["compression"] | "");
+
+            // optional integrity: SHA-256 and its signature of the image as
+            // flashed, and a list of SHA-256 hashes of blockSize blocks of bin
+            _sha256 = String(JSONDocument["sha256"] | "");
+            _signature = String(JSONDocument["signature"] | "");
+            _blocksPath = String(JSONDocument["blocks"] | "");
+            _blockSize = JSONDocument["blockSize"] | 0;
         }
-        else
-        {
-            // not enough space to begin OTA
-            // Understand the partitions and
-            // space availability
-            ESP_LOGE(TAG, "Not enough space to begin OTA");
-            _client->flush();
 
-            return false;
+        if (!isArray)
+        {
+            break;
+        }
+        int separator = stream.skipSpace();
+        stream.read();
+        if (separator == ']')
+        {
+            break;
         }
+        parsed = separator == ',';
     }
-    else
+
+    // the connection is only kept when the whole body was read, see below
+    bool keepSession = response.keepAlive && parsed && stream.drain();
+    if (!parsed)
     {
-        ESP_LOGE(TAG, "There was no content in the response or the content type was not application/octet-stream");
-        _client->flush();
+        _sessionClose();
+    }
+    _blockingNetworkSemaphoreGive();
 
+    if (!parsed)
+    {
+        _idleWait(5000, _pollStop, true);
         return false;
     }
-}
-
-bool esp32FOTAGSM::execHTTPcheck()
-{
-    int contentLength = 0;
-    bool isValidContentType = false;
-    bool gotHTTPStatus = false;
-
-    String useURL;
 
-    if (useDeviceID)
+    ESP_LOGD(TAG, "%d manifest entries", entries);
+    bool updateAvailable = plversion >= 0;
+    if (updateAvailable)
     {
-        useURL = checkRESOURCE + "?id=" + _getDeviceID();
+        ESP_LOGD(TAG, "New firmware available");
+        ESP_LOGD(TAG, "version %d", plversion);
+        _updateVersion = plversion;
+        ESP_LOGD(TAG, "Host: %s", _host.c_str());
+        ESP_LOGD(TAG, "bin: %s", _bin.c_str());
+        ESP_LOGD(TAG, "checksum %s", _checksum.c_str());
     }
     else
     {
-        useURL = checkRESOURCE;
+        ESP_LOGD(TAG, "No new firmware available");
     }
 
-    _port = 80;
-
-    ESP_LOGD(TAG, "Getting %s", useURL.c_str());
-
-    //current connection status should be checked before calling this function
+    _manifestETag = response.etag;
+    _manifestLastModified = response.lastModified;
+    _manifestUpdate = updateAvailable;
+    _saveManifestCache();
 
-    _client->setTimeout(CLIENT_TIMEOUT_MS);
+    return _finishCheck(updateAvailable, keepSession);
+}
 
-    _blockingNetworkSemaphoreTake();
-    if (_client->connect(checkHOST.c_str(), checkPORT))
+// Note the installed update in NVS, the new firmware validates it with beginValidation()
+void esp32FOTAGSM::_savePending()
+{
+    Preferences prefs;
+    if (!prefs.begin(ROLLBACK_NVS_NAMESPACE, false))
     {
-        // Connection Succeed.
-
-        // Get the contents of the bin file
-        _client->print(String("GET ") + checkRESOURCE + " HTTP/1.1\r\n" +
-                       "Host: " + checkHOST + "\r\n" +
-                       "Cache-Control: no-cache\r\n" +
-                       "Connection: close\r\n\r\n");
-
-        unsigned long timeout = millis();
-        while (_client->available() == 0)
-        {
-            if (millis() - timeout > CLIENT_TIMEOUT_MS)
-            {
-                ESP_LOGD(TAG, "Client Timeout !");
-                _client->stop();
-                _blockingNetworkSemaphoreGive();
-                return false;
-            }
-        }
-
-        while (_client->available())
-        {
-            String header, headerValue;
-            // read line till /n
-            String line = _client->readStringUntil('\n');
-
-            ESP_LOGD(TAG, "Header line: %s", line.c_str());
-
-            // remove space, to check if the line is end of headers
-            line.trim();
+        return;
+    }
+    prefs.putBool("pending", true);
+    prefs.putInt("to", _updateVersion);
+    prefs.putString("prev", esp_ota_get_running_partition()->label);
+    prefs.putUChar("boots", 0);
+    prefs.end();
+}
 
-            if (!line.length())
-            {
-                //headers ended
-                break; // and get the OTA started
-            }
+// The outcome of the last update still to be reported and the rolled back version
+void esp32FOTAGSM::_loadRollbackState(String &report)
+{
+    Preferences prefs;
+    if (!prefs.begin(ROLLBACK_NVS_NAMESPACE, true))
+    {
+        return;
+    }
+    report = prefs.getString("report");
+    _rejectedVersion = prefs.getInt("rejected", -1);
+    prefs.end();
+}
 
-            // Check if the HTTP Response is 200
-            // else break and Exit Update
-            if (line.startsWith("HTTP/1.1"))
-            {
-                if (line.indexOf("200") < 0)
-                {
-                    ESP_LOGD(TAG, "Got a non 200 status code from server. Exiting OTA Update.");
-                    _client->stop();
-                    break;
-                }
-                gotHTTPStatus = true;
-            }
+void esp32FOTAGSM::_clearReport()
+{
+    Preferences prefs;
+    if (prefs.begin(ROLLBACK_NVS_NAMESPACE, false))
+    {
+        prefs.remove("report");
+        prefs.end();
+    }
+}
 
-            if (false == gotHTTPStatus)
-            {
-                continue;
-            }
+// End the validation of the pending update with "confirmed" or "reverted" for
+// the next check, a reverted version is not installed again
+void esp32FOTAGSM::_saveOutcome(const char *outcome, bool rejected)
+{
+    Preferences prefs;
+    if (!prefs.begin(ROLLBACK_NVS_NAMESPACE, false))
+    {
+        return;
+    }
+    int version = prefs.getInt("to", -1);
+    prefs.putString("report", String(outcome) + " " + String(version));
+    if (rejected && version >= 0)
+    {
+        prefs.putInt("rejected", version);
+        _rejectedVersion = version;
+    }
+    prefs.remove("pending");
+    prefs.remove("boots");
+    prefs.end();
+}
 
-            splitHeader(line, header, headerValue);
+// Keep the connection for execOTA() if the bin is on the same server
+bool esp32FOTAGSM::_finishCheck(bool updateAvailable, bool keepSession)
+{
+    _checkFailed = false;
 
-            // extract headers here
-            // Start with content length
-            if (header.equalsIgnoreCase("Content-Length"))
-            {
-                contentLength = headerValue.toInt();
-                ESP_LOGD(TAG, "Content-Length: %d", contentLength);
-                continue;
-            }
+    // reaching the server is the first sign that new firmware works
+    if (_validating && (_healthCheckFunction == NULL || _healthCheckFunction()))
+    {
+        confirmUpdate();
+    }
 
-            // Next, the content type
-            if (header.equalsIgnoreCase("Content-type"))
-            {
-                String contentType = headerValue;
-                ESP_LOGD(TAG, "Content-type: %s", contentType.c_str());
-                if (contentType == "application/json")
-                {
-                    ESP_LOGD(TAG, "Valid Content-type");
-                    isValidContentType = true;
-                }
-            }
-        }
+    if (updateAvailable && !_preflight())
+    {
+        ESP_LOGD(TAG, "An update is available but cannot be installed now");
+        updateAvailable = false;
+    }
 
-        // check if the contectLength is bigger than the buffer size
-        if (contentLength > 256)
-        {
-            ESP_LOGD(TAG, "contentLength is bigger than 256 bytes. Exiting Update check.");
-            _client->stop();
-            _blockingNetworkSemaphoreGive();
-            return false;
-        }
+    if (!(updateAvailable && keepSession && _host == checkHOST && _port == checkPORT))
+    {
+        _sessionClose();
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Keeping the connection to %s open for the download", _host.c_str());
+    }
 
-        // check contentLength and content type
-        if (contentLength && isValidContentType)
-        {
-            char JSONMessage[256];
-            _client->readBytes(JSONMessage, contentLength);
+    return updateAvailable;
+}
 
-            _client->stop();
-            _blockingNetworkSemaphoreGive();
+// The validators of a manifest that had no update for this firmware survive a
+// reboot in NVS. One with an update is only kept in RAM together with the
+// selected entry.
+void esp32FOTAGSM::_loadManifestCache()
+{
+    if (_manifestCacheLoaded)
+    {
+        return;
+    }
+    _manifestCacheLoaded = true;
 
-            StaticJsonDocument<300> JSONDocument; //Memory pool
-            DeserializationError err = deserializeJson(JSONDocument, JSONMessage);
+    Preferences prefs;
+    if (!prefs.begin(MANIFEST_NVS_NAMESPACE, true))
+    {
+        return;
+    }
+    if (prefs.getString("url") == checkHOST + checkRESOURCE &&
+        prefs.getString("type") == _firwmareType &&
+        prefs.getInt("version", -1) == _firwmareVersion)
+    {
+        _manifestETag = prefs.getString("etag");
+        _manifestLastModified = prefs.getString("modified");
+        _manifestUpdate = false;
+    }
+    prefs.end();
+}
 
-            if (err)
-            { //Check for errors in parsing
-                ESP_LOGD(TAG, "Parsing failed");
-                delay(5000);
-                return false;
-            }
+void esp32FOTAGSM::_saveManifestCache()
+{
+    Preferences prefs;
+    if (!prefs.begin(MANIFEST_NVS_NAMESPACE, false))
+    {
+        return;
+    }
 
-            const char *pltype = JSONDocument["type"];
-            int plversion = JSONDocument["version"];
-            const char *plhost = JSONDocument["host"];
-            const char *plbin = JSONDocument["bin"];
-            const char *plckecksum = JSONDocument["checksum"];
-            _port = JSONDocument["port"];
+    bool cacheable = !_manifestUpdate && (_manifestETag.length() > 0 || _manifestLastModified.length() > 0);
+    if (cacheable)
+    {
+        prefs.putString("url", checkHOST + checkRESOURCE);
+        prefs.putString("type", _firwmareType);
+        prefs.putInt("version", _firwmareVersion);
+        prefs.putString("etag", _manifestETag);
+        prefs.putString("modified", _manifestLastModified);
+    }
+    else if (prefs.isKey("url"))
+    {
+        prefs.clear();
+    }
+    prefs.end();
+}
 
-            ESP_LOGD(TAG, "Available update: ");
-            ESP_LOGD(TAG, "type %s", pltype);
-            ESP_LOGD(TAG, "version %d", plversion);
-            ESP_LOGD(TAG, "Host: %s", plhost);
-            ESP_LOGD(TAG, "bin: %s", plbin);
-            ESP_LOGD(TAG, "checksum %s", plckecksum);
+// Connect the client to host:port, reusing the open connection when it goes to the
+// same server, the server agreed to keep it alive and it was used recently
+bool esp32FOTAGSM::_sessionConnect(const String &host, int port)
+{
+    if (_client->connected() && _sessionKeepAlive &&
+        _sessionPort == port && _sessionHost == host &&
+        millis() - _sessionLastUsed < _keepAliveIdleMs)
+    {
+        ESP_LOGD(TAG, "Reusing the connection to %s:%d", host.c_str(), port);
+        _sessionLastUsed = millis();
+        return true;
+    }
 
-            _host = String(plhost);
-            _bin = String(plbin);
-            _checksum = String(plckecksum);
+    _sessionClose();
+    unsigned long start = millis();
+    bool connected = _client->connect(host.c_str(), port);
+    uint32_t connectMs = millis() - start;
 
-            if (String(pltype) == _firwmareType)
-            {
-                if (plversion > _firwmareVersion)
-                {
-                    ESP_LOGD(TAG, "New firmware available");
-                    return true;
-                }
-                else
-                {
-                    ESP_LOGD(TAG, "No new firmware available");
-                    return false;
-                }
-            }else{
-                ESP_LOGD(TAG, "Wrong firmware type");
-                return false;
-            }
-        }
-        else
-        {
-            ESP_LOGD(TAG, "There was no content in the response");
-            _client->flush();
+    if (_metrics.connects > 0)
+    {
+        _metrics.reconnects++;
+    }
+    _metrics.connects++;
+    _metrics.connectTotalMs += connectMs;
+    if (connectMs > _metrics.connectMaxMs)
+    {
+        _metrics.connectMaxMs = connectMs;
+    }
+    if (!connected)
+    {
+        return false;
+    }
 
-            _client->stop();
-            _blockingNetworkSemaphoreGive();
+    _sessionHost = host;
+    _sessionPort = port;
+    _sessionKeepAlive = true;
+    _sessionLastUsed = millis();
+    return true;
+}
 
-            return false;
-        }
+// stop() talks to the modem, so the network semaphore is taken for it unless
+// the caller holds it already
+void esp32FOTAGSM::_sessionClose()
+{
+    bool lock = _networkSemaphore != NULL && !_lockHeld;
+    if (lock)
+    {
+        _blockingNetworkSemaphoreTake();
     }
-    else
+    _client->stop();
+    _sessionHost = "";
+    _sessionPort = 0;
+    _sessionKeepAlive = false;
+    if (lock)
     {
-        // Connect to webserver failed
-        ESP_LOGD(TAG, "Connection to %s failed.", checkHOST.c_str());
-
         _blockingNetworkSemaphoreGive();
-        return false;
     }
 }
 
+// Note whether the server will keep the connection after this response
+void esp32FOTAGSM::_sessionUpdate(const HTTPResponse &response)
+{
+    _sessionKeepAlive = response.keepAlive;
+    _sessionLastUsed = millis();
+}
+
 String esp32FOTAGSM::_getDeviceID()
 {
     char deviceid[21];
@@ -724,7 +3709,24 @@ void esp32FOTAGSM::forceUpdate(String firmwareHost, int firmwarePort, String fir
     _host = firmwareHost;
     _bin = firmwarePath;
     _port = firmwarePort;
+    _mirrorHosts[0] = firmwareHost;
+    _mirrorPorts[0] = firmwarePort;
+    _mirrorCount = 1;
     _checksum = checksum;
+    _updateVersion = -1;
+    _imageSize = 0;
+    _compression = "";
+    _deltaBin = "";
+    _sha256 = "";
+    _signature = "";
+    _blocksPath = "";
+    for (uint8_t i = 0; i < _targetCount; i++)
+    {
+        _targets[i].bin = "";
+    }
+    // the manifest entry these replaced is gone, check it again next time
+    _manifestETag = "";
+    _manifestLastModified = "";
     execOTA();
 }
 
@@ -739,8 +3741,305 @@ void esp32FOTAGSM::setConnectionCheckFunction(TConnectionCheckFunction connectio
     this->_connectionCheckFunction = connectionCheckFunction;
 }
 
+// Reports registration, signal and technology of the modem, called like the
+// connection check function from the OTA task before every chunk
+void esp32FOTAGSM::setLinkQualityFunction(TLinkQualityFunction linkQualityFunction)
+{
+    this->_linkQualityFunction = linkQualityFunction;
+}
+
+// Below minRssi (dBm) downloads pause and polling waits, for at most maxPauseMs
+// in a download. Below goodRssi the smallest adaptive chunk size is used.
+void esp32FOTAGSM::setLinkPolicy(int16_t minRssi, int16_t goodRssi, unsigned long maxPauseMs)
+{
+    this->_linkMinRssi = minRssi;
+    this->_linkGoodRssi = goodRssi;
+    this->_linkMaxPauseMs = maxPauseMs;
+}
+
+// Called before an update is reported by execHTTPcheck() and before it is
+// downloaded, e.g. to check the battery voltage and signal quality
+void esp32FOTAGSM::setPreflightCheck(TPreflightFunction preflightFunction)
+{
+    this->_preflightFunction = preflightFunction;
+}
+
+// Sleep during waits of at least minSleepMs: retry backoffs, link pauses and the
+// time between polls. SLEEP_LIGHT stops every task until the wait is over or
+// the modem sends data on wakeupUart (0 or 1, -1 for none); the bytes that wake
+// the chip are lost.
+void esp32FOTAGSM::setSleepPolicy(SleepMode mode, unsigned long minSleepMs, int wakeupUart)
+{
+    this->_sleepMode = mode;
+    this->_sleepMinMs = minSleepMs;
+    this->_wakeupUart = wakeupUart;
+}
+
+void esp32FOTAGSM::setModemSleepFunction(TModemSleepFunction modemSleepFunction)
+{
+    this->_modemSleepFunction = modemSleepFunction;
+}
+
+// Average power of the board awake (ESP32 and modem receiving) and during the
+// waits the sleep policy sleeps through, for OTAMetrics::energyMj
+void esp32FOTAGSM::setPowerModel(uint16_t awakeMilliwatts, uint16_t sleepMilliwatts)
+{
+    this->_awakeMilliwatts = awakeMilliwatts;
+    this->_sleepMilliwatts = sleepMilliwatts;
+}
+
 void esp32FOTAGSM::setNetworkSemaphore(SemaphoreHandle_t networkSemaphore)
 {
     this->_networkSemaphore = networkSemaphore;
 }
 
+// Time the download sleeps between chunks after giving the network semaphore
+// back, 0 only yields to tasks of the same priority
+void esp32FOTAGSM::setNetworkYield(unsigned long yieldMs)
+{
+    this->_networkYieldMs = yieldMs;
+}
+
+esp32FOTAGSM::NetworkLockStats esp32FOTAGSM::getNetworkLockStats()
+{
+    return _lockStats;
+}
+
+void esp32FOTAGSM::resetNetworkLockStats()
+{
+    _lockStats = NetworkLockStats();
+}
+
+// set the function called when an update started with startOTA() finishes
+void esp32FOTAGSM::setMetricsCallback(TMetricsCallback metricsCallback)
+{
+    this->_metricsCallback = metricsCallback;
+}
+
+// Metrics of the last update, or of the running one so far
+esp32FOTAGSM::OTAMetrics esp32FOTAGSM::getMetrics()
+{
+    OTAMetrics metrics = _metrics;
+    metrics.bytesPerSecond = metrics.receiveMs > 0 ? (uint64_t)metrics.bytesReceived * 1000 / metrics.receiveMs : 0;
+    // mW times ms gives uJ
+    uint32_t awakeMs = metrics.totalMs > metrics.sleepMs ? metrics.totalMs - metrics.sleepMs : 0;
+    metrics.energyMj = ((uint64_t)awakeMs * _awakeMilliwatts + (uint64_t)metrics.sleepMs * _sleepMilliwatts) / 1000;
+    return metrics;
+}
+
+void esp32FOTAGSM::setCompletionCallback(TCompletionCallback completionCallback)
+{
+    this->_completionCallback = completionCallback;
+}
+
+// Number of download buffers. With 2 or more, flash writes overlap with the
+// download of the next chunk (each buffer takes one chunk of RAM, see setChunkBuffer())
+void esp32FOTAGSM::setPipelineDepth(uint8_t buffers)
+{
+    if (buffers < 1)
+    {
+        buffers = 1;
+    }
+    if (buffers > MAX_PIPELINE_DEPTH)
+    {
+        buffers = MAX_PIPELINE_DEPTH;
+    }
+    this->_pipelineDepth = buffers;
+}
+
+// Size of each download buffer, which is also the Range chunk size. The buffers
+// are allocated when a ranged download starts and freed when it ends; with
+// usePSRAM they come from PSRAM if the board has it.
+void esp32FOTAGSM::setChunkBuffer(size_t size, bool usePSRAM)
+{
+    this->_poolBufferSize = size;
+    this->_poolUsePSRAM = usePSRAM;
+    this->_userBuffer = NULL;
+    this->_userBufferSize = 0;
+}
+
+// Use a caller owned buffer for the download. It is split between the pipeline
+// buffers and never freed by the library.
+void esp32FOTAGSM::setChunkBuffer(uint8_t *buffer, size_t size)
+{
+    this->_userBuffer = buffer;
+    this->_userBufferSize = size;
+    this->_poolBufferSize = size;
+}
+
+// Let the Range chunk size adapt to the link: downloads start with minSize byte
+// chunks, double after growAfter clean chunks and halve after a short read or a
+// timeout, never going over maxSize (which becomes the buffer size)
+void esp32FOTAGSM::setAdaptiveChunkSize(size_t minSize, size_t maxSize, uint8_t growAfter)
+{
+    this->_chunkMin = minSize;
+    this->_chunkGrowAfter = growAfter > 0 ? growAfter : 1;
+    if (this->_userBuffer == NULL)
+    {
+        this->_poolBufferSize = maxSize;
+    }
+}
+
+// Chunk size the ranged download currently uses, for telemetry
+size_t esp32FOTAGSM::getChunkSize()
+{
+    return _chunkSize;
+}
+
+// Keep ranged downloads across reboots and power loss. The image is written
+// straight to the OTA partition and the offset and MD5 state are checkpointed to
+// NVS every checkpointInterval bytes (rounded to whole flash sectors).
+// Not supported with flash encryption.
+void esp32FOTAGSM::setResumable(bool resumable, size_t checkpointInterval)
+{
+    this->_resumable = resumable;
+    checkpointInterval -= checkpointInterval % FLASH_SECTOR_SIZE;
+    this->_checkpointInterval = checkpointInterval > 0 ? checkpointInterval : FLASH_SECTOR_SIZE;
+}
+
+// Download into the data partition with this label first and install from there
+// once the download is complete, NULL downloads straight into the OTA partition
+bool esp32FOTAGSM::setStagingPartition(const char *label)
+{
+    if (label == NULL)
+    {
+        this->_stagingPartition = NULL;
+        return true;
+    }
+    this->_stagingPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (this->_stagingPartition == NULL)
+    {
+        ESP_LOGE(TAG, "No data partition %s", label);
+        return false;
+    }
+    return true;
+}
+
+// Take the image size and type from the response to the first Range request
+// instead of a separate HEAD request, and keep using that connection
+void esp32FOTAGSM::setSkipHeadRequest(bool skipHead)
+{
+    this->_skipHead = skipHead;
+}
+
+// Request the rest of the image with one open-ended Range and read it chunk by
+// chunk, instead of one request per chunk. After a short read or a corrupt
+// block the rest is requested again from the last written byte.
+void esp32FOTAGSM::setStreamingDownload(bool streaming)
+{
+    this->_streaming = streaming;
+}
+
+// Keep the connection open between the manifest check, the HEAD request and the
+// download when they go to the same server. A connection idle for more than
+// idleTimeoutMs is not reused, servers usually drop those.
+void esp32FOTAGSM::setKeepAlive(bool keepAlive, unsigned long idleTimeoutMs)
+{
+    this->_keepAlive = keepAlive;
+    this->_keepAliveIdleMs = idleTimeoutMs;
+}
+
+// Sent with every request, "<type>/<version> esp32FOTAGSM" by default
+void esp32FOTAGSM::setUserAgent(const String &userAgent)
+{
+    this->_userAgent = userAgent;
+}
+
+// A header sent with every request, e.g. an auth token
+void esp32FOTAGSM::addRequestHeader(const String &name, const String &value)
+{
+    this->_requestHeaders += name + ": " + value + "\r\n";
+}
+
+void esp32FOTAGSM::clearRequestHeaders()
+{
+    this->_requestHeaders = "";
+}
+
+// PEM public key (RSA or EC) the SHA-256 of every image must be signed with.
+// The key is not copied and has to stay valid.
+void esp32FOTAGSM::setPublicKey(const char *publicKeyPem)
+{
+    this->_publicKey = publicKeyPem;
+}
+
+// Write the application image to this sink instead of Update, NULL for Update.
+// Resumable downloads need Update, with another sink they start over.
+void esp32FOTAGSM::setSink(esp32FOTAGSMSink *sink)
+{
+    this->_sink = sink != NULL ? sink : &this->_updateSink;
+}
+
+// Update one more image with every application update, from the "targets"
+// object of the manifest entry under this name. Replaces a target of the same name.
+// The sink has to keep the image aside until commit(), esp32FOTAGSMUpdateSink
+// writes in place and is refused.
+bool esp32FOTAGSM::addTarget(const String &name, esp32FOTAGSMSink &sink)
+{
+    if (&sink == &this->_updateSink)
+    {
+        ESP_LOGE(TAG, "The application image is the bin of the manifest entry");
+        return false;
+    }
+    if (!sink.isStaged())
+    {
+        ESP_LOGE(TAG, "Target %s would be written in place, use esp32FOTAGSMStagedSink", name.c_str());
+        return false;
+    }
+
+    uint8_t i = 0;
+    while (i < this->_targetCount && this->_targets[i].name != name)
+    {
+        i++;
+    }
+    if (i == MAX_TARGETS)
+    {
+        ESP_LOGE(TAG, "No room for target %s", name.c_str());
+        return false;
+    }
+    if (i == this->_targetCount)
+    {
+        this->_targetCount++;
+    }
+    this->_targets[i].name = name;
+    this->_targets[i].sink = &sink;
+    this->_targets[i].bin = "";
+    this->_targets[i].size = 0;
+    this->_targets[i].state = TARGET_IDLE;
+    return true;
+}
+
+void esp32FOTAGSM::clearTargets()
+{
+    this->_targetCount = 0;
+}
+
+// TARGET_IDLE for a name that is not a target
+esp32FOTAGSM::TargetState esp32FOTAGSM::getTargetState(const String &name)
+{
+    for (uint8_t i = 0; i < this->_targetCount; i++)
+    {
+        if (this->_targets[i].name == name)
+        {
+            return this->_targets[i].state;
+        }
+    }
+    return TARGET_IDLE;
+}
+
+// maxRetries consecutive failed chunks before giving up, 10 by default.
+// 0 retries forever, an update then only ends with abortOTA().
+void esp32FOTAGSM::setRetryPolicy(uint16_t maxRetries, unsigned long retryDelayMs, unsigned long maxRetryDelayMs)
+{
+    this->_maxRetries = maxRetries;
+    this->_retryDelayMs = retryDelayMs;
+    this->_maxRetryDelayMs = maxRetryDelayMs > retryDelayMs ? maxRetryDelayMs : retryDelayMs;
+}
+
+void esp32FOTAGSM::setPollInterval(unsigned long intervalMs, unsigned long maxBackoffMs, uint8_t jitterPercent)
+{
+    this->_pollIntervalMs = intervalMs;
+    this->_pollMaxBackoffMs = maxBackoffMs > intervalMs ? maxBackoffMs : intervalMs;
+    this->_jitterPercent = jitterPercent > 100 ? 100 : jitterPercent;
+}
+
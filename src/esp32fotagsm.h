@@ -1,7 +1,7 @@
 /*
    esp32 firmware OTA
    Date: December 2018   
-   Purpose: Perform an OTA update from a bin located on a webserver (HTTP Only)
+   Purpose: Perform an OTA update from a bin located on a webserver (HTTP, or HTTPS through esp32FOTAGSMSecureClient)
 */
 
 #ifndef esp32FOTAGSM_h
@@ -10,35 +10,311 @@
 #include "Arduino.h"
 #include <FreeRTOS.h>
 #include <functional>
+#include <esp_partition.h>
+#include <esp_rom_md5.h>
+#include "esp32fotagsm_inflate.h"
+#include "esp32fotagsm_delta.h"
+#include "esp32fotagsm_verify.h"
+#include "esp32fotagsm_sink.h"
+
+#define DOWNLOAD_CHUNK_SIZE (16380)//(8192)
+#define MAX_PIPELINE_DEPTH (4)
+#define MAX_MIRRORS (4)
+#define MAX_TARGETS (4)
+#define REQUEST_BUFFER_SIZE (768)
 
 class esp32FOTAGSM
 {
 public:
   typedef std::function<bool(void)> TConnectionCheckFunction;
+  enum LinkTechnology
+  {
+    LINK_UNKNOWN,
+    LINK_2G,   // GSM, GPRS, EDGE
+    LINK_3G,   // UMTS, HSPA
+    LINK_4G,   // LTE, LTE-M
+    LINK_NBIOT
+  };
+
+  // What the modem reports about the cellular link
+  struct LinkQuality
+  {
+    bool registered;           // registered on a network, home or roaming
+    int16_t rssi;              // dBm, e.g. -113 + 2 * CSQ
+    LinkTechnology technology;
+  };
+
+  typedef std::function<LinkQuality(void)> TLinkQualityFunction;
+
+  enum SleepMode
+  {
+    SLEEP_NONE,  // waits block the OTA task, other tasks keep running
+    SLEEP_LIGHT  // long waits put the whole chip into light sleep
+  };
+
+  // Called with true before a long wait and with false after it, e.g. to put
+  // the modem into PSM or DTR sleep and wake it again
+  typedef std::function<void(bool sleep)> TModemSleepFunction;
+
+  // Whether the new firmware works, e.g. its sensors and peripherals answer
+  typedef std::function<bool(void)> THealthCheckFunction;
+
+  // Whether the device can afford an update now (battery, signal), imageSize is 0 if unknown
+  typedef std::function<bool(size_t imageSize)> TPreflightFunction;
+
+  enum OTAState
+  {
+    OTA_IDLE,        // no update has been started
+    OTA_CONNECTING,  // fetching the bin headers
+    OTA_DOWNLOADING, // downloading and writing the image
+    OTA_VERIFYING,   // finishing the update and checking the MD5
+    OTA_DONE,        // image written, a reboot will boot the new firmware
+    OTA_FAILED,
+    OTA_ABORTED
+  };
+
+  // Called from the OTA task once the update finished (OTA_DONE, OTA_FAILED or OTA_ABORTED)
+  typedef std::function<void(OTAState state)> TCompletionCallback;
+
+  // How far an image of a multi-target update got in the last update
+  enum TargetState
+  {
+    TARGET_IDLE,      // not part of the update
+    TARGET_STARTED,   // between begin() and end() of its sink
+    TARGET_ENDED,     // complete and checked, waiting for commit()
+    TARGET_COMMITTED, // active, even if a later image failed
+    TARGET_FAILED     // aborted, or failed before begin()
+  };
+
+  // How long the library waited for and held the network semaphore
+  struct NetworkLockStats
+  {
+    uint32_t takes;
+    uint32_t waitTotalMs;
+    uint32_t waitMaxMs;
+    uint32_t holdTotalMs;
+    uint32_t holdMaxMs;
+  };
+
+  // Counters and timings of the last update or manifest check, times in ms
+  struct OTAMetrics
+  {
+    uint32_t totalMs;        // wall time of the update, 0 after a check
+    uint32_t connects;       // connections opened, reused ones not counted
+    uint32_t reconnects;     // connections opened after the first one
+    uint32_t connectTotalMs;
+    uint32_t connectMaxMs;
+    uint32_t requests;
+    uint32_t timeouts;       // requests without a response
+    uint32_t ttfbTotalMs;    // from sending a request to the first response byte
+    uint32_t ttfbMaxMs;
+    uint32_t bytesReceived;  // response bodies
+    uint32_t receiveMs;      // time spent reading response bodies
+    uint32_t bytesPerSecond; // bytesReceived over receiveMs
+    uint32_t shortReads;     // chunks that ended before the requested range
+    uint32_t retries;
+    uint32_t mirrorSwitches; // failovers to another mirror during the download
+    uint32_t networkWaitMs;  // waiting for the network semaphore
+    uint32_t linkWaitMs;     // paused for a weak signal or no registration
+    uint32_t flashWrites;
+    uint32_t flashWriteMs;   // decompressing, patching and writing to flash
+    uint32_t sleepMs;        // waits spent in light sleep or with the modem asleep
+    uint32_t energyMj;       // estimated from setPowerModel(), 0 without one
+  };
+
+  // Called from the OTA task when an update ends, before the completion callback
+  typedef std::function<void(const OTAMetrics &metrics)> TMetricsCallback;
 
   esp32FOTAGSM(Client &client, String firwmareType, int firwmareVersion,
                TConnectionCheckFunction connectionCheckFunction,
                SemaphoreHandle_t networkSemaphore,
                int ledPin = -1,
                uint8_t ledOn = LOW,
-               bool chunkedDownload = false
+               bool chunkedDownload = false,
+               size_t chunkSize = DOWNLOAD_CHUNK_SIZE
                );
 
   void forceUpdate(String firwmareHost, int firwmarePort, String firwmarePath, String checksum);
   bool execOTA();
+  bool startOTA(BaseType_t core = 1, uint32_t stackSize = 8192, UBaseType_t priority = 1);
+  bool startPolling(BaseType_t core = 1, uint32_t stackSize = 8192, UBaseType_t priority = 1);
+  void stopPolling();
+  bool isPolling();
+  void abortOTA();
+  bool isOTARunning();
+  OTAState getState();
+  int getProgress();
+  size_t getBytesWritten();
+  size_t getImageSize();
   bool execHTTPcheck();
   bool useDeviceID;
+  bool useVersion;
   String checkHOST;     // example.com
   int checkPORT;        // 80
   String checkRESOURCE; // /customer01/firmware.json
   void setClient(Client &client);
   void setConnectionCheckFunction(TConnectionCheckFunction connectionCheckFunction);
+  void setPreflightCheck(TPreflightFunction preflightFunction);
+  bool beginValidation(unsigned long timeoutMs = 600000, uint8_t maxBoots = 3);
+  void setHealthCheck(THealthCheckFunction healthCheckFunction);
+  bool isValidating();
+  void confirmUpdate();
+  void rejectUpdate();
+  void setLinkQualityFunction(TLinkQualityFunction linkQualityFunction);
+  void setLinkPolicy(int16_t minRssi, int16_t goodRssi = -85, unsigned long maxPauseMs = 600000);
+  void setSleepPolicy(SleepMode mode, unsigned long minSleepMs = 2000, int wakeupUart = -1);
+  void setModemSleepFunction(TModemSleepFunction modemSleepFunction);
+  void setPowerModel(uint16_t awakeMilliwatts, uint16_t sleepMilliwatts);
   void setNetworkSemaphore(SemaphoreHandle_t networkSemaphore);
+  void setNetworkYield(unsigned long yieldMs);
+  NetworkLockStats getNetworkLockStats();
+  void resetNetworkLockStats();
+  void setCompletionCallback(TCompletionCallback completionCallback);
+  void setMetricsCallback(TMetricsCallback metricsCallback);
+  OTAMetrics getMetrics();
+  void setRetryPolicy(uint16_t maxRetries, unsigned long retryDelayMs = 5000, unsigned long maxRetryDelayMs = 60000);
+  void setPollInterval(unsigned long intervalMs, unsigned long maxBackoffMs = 21600000, uint8_t jitterPercent = 20);
+  void setPipelineDepth(uint8_t buffers);
+  void setChunkBuffer(size_t size, bool usePSRAM = true);
+  void setChunkBuffer(uint8_t *buffer, size_t size);
+  void setAdaptiveChunkSize(size_t minSize, size_t maxSize, uint8_t growAfter = 2);
+  size_t getChunkSize();
+  void setResumable(bool resumable, size_t checkpointInterval = 65536);
+  bool setStagingPartition(const char *label);
+  void setSkipHeadRequest(bool skipHead);
+  void setStreamingDownload(bool streaming);
+  void setKeepAlive(bool keepAlive, unsigned long idleTimeoutMs = 10000);
+  void setUserAgent(const String &userAgent);
+  void addRequestHeader(const String &name, const String &value);
+  void clearRequestHeaders();
+  void setPublicKey(const char *publicKeyPem);
+  void setSink(esp32FOTAGSMSink *sink);
+  bool addTarget(const String &name, esp32FOTAGSMSink &sink);
+  void clearTargets();
+  TargetState getTargetState(const String &name);
+  void notifyDataAvailable();
+  void notifyDataAvailableFromISR();
 
 private:
+  struct WriterChunk
+  {
+    uint8_t *data;
+    size_t length;
+  };
+
+  struct HTTPResponse
+  {
+    int status;
+    int contentLength; // -1 if not sent
+    char contentType[40];
+    char contentEncoding[16];
+    bool acceptRanges;
+    bool keepAlive;
+    bool hasRange;
+    uint32_t rangeStart;
+    uint32_t rangeEnd;
+    uint32_t rangeTotal;
+    char etag[64];
+    char lastModified[40];
+    uint32_t retryAfter; // seconds, 0 if not sent
+  };
+
+  enum RangeCheck
+  {
+    RANGE_OK,
+    RANGE_RETRY, // misaligned or inconsistent, ask for the chunk again
+    RANGE_FATAL  // the server no longer serves the image we are downloading
+  };
+
+  struct ResumeState
+  {
+    uint32_t offset;
+    md5_context_t md5;
+  };
+
+  struct Target
+  {
+    String name;
+    esp32FOTAGSMSink *sink;
+    String bin; // from the manifest entry, empty if the entry has none
+    String checksum;
+    size_t size;
+    TargetState state;
+  };
+
+  static void _otaTask(void *param);
+  static void _writerTask(void *param);
+  static void _validationTask(void *param);
+  uint8_t _poolAcquire(uint8_t count);
+  void _poolRelease();
+  void _abortDownload();
+  void _adaptChunkSize(bool clean, size_t minSize, size_t maxSize);
+  bool _flashBegin(size_t size, bool resumable, const char *imageTag);
+  size_t _flashWrite(uint8_t *data, size_t length);
+  bool _flashEnd();
+  bool _finishImage(bool encoded, bool complete);
+  bool _installStaged(bool delta, esp32FOTAGSMInflater::Format compression, size_t imageSize);
+  size_t _imageWrite(uint8_t *data, size_t length);
+  size_t _decodedWrite(uint8_t *data, size_t length);
+  size_t _streamToImage(size_t contentLength);
+  size_t _readBody(uint8_t *buffer, size_t length);
+  bool _verifyImage();
+  bool _fetchBlockHashes(uint8_t *&hashes, size_t &count);
+  void _flashAbort();
+  bool _resumeBegin(const esp_partition_t *partition, size_t size, const char *imageTag);
+  void _saveCheckpoint();
+  void _clearCheckpoint();
+  bool _startWriter();
+  bool _stopWriter();
+  void _releaseWriterResources();
+  uint8_t *_acquireBuffer();
+  void _submitBuffer(uint8_t *buffer, size_t length);
+  bool _runOTA();
+  bool _performOTA(bool delta);
+  void _requestBegin(const char *method, const String &host, const char *path);
+  void _requestAppend(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  bool _requestSend(bool keepAlive);
+  int _readLine(char *line, size_t size);
+  bool _readResponseHeaders(HTTPResponse &response);
+  RangeCheck _checkRange(const HTTPResponse &range, uint32_t first, uint32_t last, uint32_t total);
+  bool _fetchHead(HTTPResponse &response);
+  bool _fetchFirstRange(HTTPResponse &response);
+  bool _downloadRanged(size_t contentLength, bool pending, const HTTPResponse &first, size_t &total_written_bytes);
+  bool _downloadFull(size_t contentLength, bool pending, size_t &total_written_bytes);
+  bool _sessionConnect(const String &host, int port);
+  void _sessionClose();
+  void _sessionUpdate(const HTTPResponse &response);
+  void _loadManifestCache();
+  void _saveManifestCache();
+  bool _finishCheck(bool updateAvailable, bool keepSession);
+  bool _retryWait(uint16_t &retries);
+  void _selectMirror();
+  long _probeMirror(uint8_t mirror);
+  void _useMirror(uint8_t mirror);
+  void _saveMirror(bool winner);
+  bool _downloadTargets();
+  bool _fetchTarget(Target &target);
+  bool _finishTargets(bool success);
+  void _pollLoop();
+  bool _pollWait(unsigned long ms);
+  unsigned long _idleWait(unsigned long ms, const volatile bool &stop, bool modemSleep);
+  unsigned long _nextDelay(unsigned long baseMs, uint16_t attempt, unsigned long maxMs);
+  unsigned long _jitter(unsigned long ms);
+  uint32_t _random();
+  void _setState(OTAState state);
+  bool _waitForData(unsigned long timeoutMs);
+  bool _waitForResponse();
   bool _checkConnection();
+  bool _preflight();
+  void _savePending();
+  void _loadRollbackState(String &report);
+  void _clearReport();
+  void _saveOutcome(const char *outcome, bool rejected);
+  bool _linkUsable(const LinkQuality &link);
+  bool _waitForLink(size_t minChunkSize, size_t maxChunkSize);
   void _blockingNetworkSemaphoreTake();
   void _blockingNetworkSemaphoreGive();
+  void _networkYield();
   String _getDeviceID();
 
   String _firwmareType;
@@ -47,12 +323,129 @@ private:
   String _bin;
   String _checksum;
   int _port;
+  String _mirrorHosts[MAX_MIRRORS]; // the manifest host first
+  int _mirrorPorts[MAX_MIRRORS];
+  uint8_t _mirrorCount;
+  uint8_t _mirror;
+  Target _targets[MAX_TARGETS];
+  uint8_t _targetCount;
   Client *_client;
   SemaphoreHandle_t _networkSemaphore;
   TConnectionCheckFunction _connectionCheckFunction;
+  TPreflightFunction _preflightFunction;
+  THealthCheckFunction _healthCheckFunction;
+  volatile bool _validating;
+  unsigned long _validationTimeoutMs;
+  TaskHandle_t _validationTaskHandle;
+  int _updateVersion;   // of the manifest entry being installed, -1 if unknown
+  int _rejectedVersion; // rolled back once, never installed again
+  TLinkQualityFunction _linkQualityFunction;
+  int16_t _linkMinRssi;
+  int16_t _linkGoodRssi;
+  unsigned long _linkMaxPauseMs;
+  bool _linkWeak;
+  SleepMode _sleepMode;
+  unsigned long _sleepMinMs;
+  int _wakeupUart;
+  TModemSleepFunction _modemSleepFunction;
+  uint16_t _awakeMilliwatts;
+  uint16_t _sleepMilliwatts;
   int _ledPin;
   uint8_t _ledOn;
   bool _chunkedDownload;
+
+  TaskHandle_t _otaTaskHandle;
+  TCompletionCallback _completionCallback;
+  volatile OTAState _state;
+  volatile bool _abortRequested;
+  volatile size_t _otaWritten;
+  volatile size_t _otaSize;
+  uint16_t _maxRetries;
+  unsigned long _retryDelayMs;
+  unsigned long _maxRetryDelayMs;
+  volatile TaskHandle_t _waitingTask;
+
+  volatile bool _polling;
+  volatile bool _pollStop;
+  unsigned long _pollIntervalMs;
+  unsigned long _pollMaxBackoffMs;
+  uint8_t _jitterPercent;
+  uint32_t _randomState;
+  unsigned long _retryAfterMs;
+  bool _checkFailed;
+
+  uint8_t _pipelineDepth;
+  TaskHandle_t _writerTaskHandle;
+  QueueHandle_t _freeBuffers;
+  QueueHandle_t _filledBuffers;
+  SemaphoreHandle_t _writerDone;
+  volatile size_t _writerWritten;
+  volatile bool _writerFailed;
+
+  uint8_t *_poolBuffers[MAX_PIPELINE_DEPTH];
+  size_t _poolBufferSize;
+  uint8_t _poolCount;
+  bool _poolUsePSRAM;
+  uint8_t *_userBuffer;
+  size_t _userBufferSize;
+
+  size_t _chunkMin;
+  uint8_t _chunkGrowAfter;
+  volatile size_t _chunkSize;
+  uint8_t _cleanChunks;
+
+  bool _resumable;
+  size_t _checkpointInterval;
+  const esp_partition_t *_partition;
+  size_t _partSize;
+  size_t _flashOffset;
+  size_t _eraseEnd;
+  md5_context_t _partMd5;
+  const esp_partition_t *_stagingPartition;
+  esp32FOTAGSMUpdateSink _updateSink;
+  esp32FOTAGSMSink *_sink;
+
+  bool _skipHead;
+  bool _streaming;
+  size_t _imageSize;
+  String _compression;
+  esp32FOTAGSMInflater _inflater;
+  String _deltaBin;
+  String _deltaCompression;
+  esp32FOTAGSMPatcher _patcher;
+  String _sha256;
+  String _signature;
+  String _blocksPath;
+  size_t _blockSize;
+  const char *_publicKey;
+  esp32FOTAGSMVerifier _verifier;
+  String _downloadPath;
+
+  char _request[REQUEST_BUFFER_SIZE];
+  size_t _requestLength;
+  bool _requestOverflow;
+  String _userAgent;
+  String _requestHeaders;
+
+  bool _keepAlive;
+  unsigned long _keepAliveIdleMs;
+  String _sessionHost;
+  int _sessionPort;
+  bool _sessionKeepAlive;
+  unsigned long _sessionLastUsed;
+
+  String _manifestETag;
+  String _manifestLastModified;
+  bool _manifestUpdate;
+  bool _manifestCacheLoaded;
+
+  unsigned long _networkYieldMs;
+  bool _lockHeld;
+  unsigned long _lockTakenAt;
+  NetworkLockStats _lockStats;
+
+  OTAMetrics _metrics;
+  TMetricsCallback _metricsCallback;
 };
 
 #endif
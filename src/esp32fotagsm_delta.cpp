@@ -0,0 +1,310 @@
+/*
+   esp32 firmware OTA
+   Purpose: Apply a binary patch against the running firmware
+*/
+
+#include "esp32fotagsm_delta.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include <esp_rom_md5.h>
+
+esp32FOTAGSMPatcher::esp32FOTAGSMPatcher()
+    : _source(NULL),
+      _output(NULL),
+      _buffer(NULL),
+      _failed(false),
+      _state(PATCH_END),
+      _count(0),
+      _op(0),
+      _argsSize(0),
+      _sourceSize(0),
+      _targetSize(0),
+      _offset(0),
+      _remaining(0),
+      _outputSize(0)
+{
+}
+
+esp32FOTAGSMPatcher::~esp32FOTAGSMPatcher()
+{
+    release();
+}
+
+uint32_t esp32FOTAGSMPatcher::_le32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+bool esp32FOTAGSMPatcher::begin(TOutputFunction output)
+{
+    release();
+
+    if (output == NULL)
+    {
+        return false;
+    }
+
+    _source = esp_ota_get_running_partition();
+    _buffer = (uint8_t *)malloc(DELTA_BUFFER_SIZE);
+    if (_source == NULL || _buffer == NULL)
+    {
+        ESP_LOGE(TAG, "Cannot apply a patch: no running partition or not enough memory");
+        release();
+        return false;
+    }
+
+    _output = output;
+    _failed = false;
+    _state = PATCH_HEADER;
+    _count = 0;
+    _sourceSize = 0;
+    _targetSize = 0;
+    _outputSize = 0;
+    return true;
+}
+
+void esp32FOTAGSMPatcher::release()
+{
+    free(_buffer);
+    _buffer = NULL;
+    _source = NULL;
+    _output = NULL;
+}
+
+bool esp32FOTAGSMPatcher::isActive()
+{
+    return _source != NULL;
+}
+
+// Number of rebuilt image bytes handed to the output so far
+size_t esp32FOTAGSMPatcher::outputSize()
+{
+    return _outputSize;
+}
+
+bool esp32FOTAGSMPatcher::_checkHeader()
+{
+    if (memcmp(_header, DELTA_MAGIC, 4) != 0)
+    {
+        ESP_LOGE(TAG, "Not a patch file");
+        return false;
+    }
+
+    _sourceSize = _le32(_header + 4);
+    _targetSize = _le32(_header + 24);
+    ESP_LOGD(TAG, "Patch from %u to %u bytes", _sourceSize, _targetSize);
+
+    if (_sourceSize == 0 || _sourceSize > _source->size)
+    {
+        ESP_LOGE(TAG, "Patch source does not fit in the running partition");
+        return false;
+    }
+    return _checkSource();
+}
+
+// MD5 of the first source size bytes of the running partition against the patch header
+bool esp32FOTAGSMPatcher::_checkSource()
+{
+    md5_context_t md5;
+    uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+
+    esp_rom_md5_init(&md5);
+    for (uint32_t offset = 0; offset < _sourceSize; offset += DELTA_BUFFER_SIZE)
+    {
+        size_t n = _sourceSize - offset;
+        if (n > DELTA_BUFFER_SIZE)
+        {
+            n = DELTA_BUFFER_SIZE;
+        }
+        if (esp_partition_read(_source, offset, _buffer, n) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Reading the running partition failed");
+            return false;
+        }
+        esp_rom_md5_update(&md5, _buffer, n);
+    }
+    esp_rom_md5_final(digest, &md5);
+
+    if (memcmp(digest, _header + 8, sizeof(digest)) != 0)
+    {
+        ESP_LOGE(TAG, "Patch was made for another firmware than the one running");
+        return false;
+    }
+    return true;
+}
+
+// Arguments of a record are complete, check them against the source
+bool esp32FOTAGSMPatcher::_startRecord()
+{
+    if (_op == 'I')
+    {
+        _remaining = _le32(_args);
+        _state = _remaining > 0 ? PATCH_INSERT : PATCH_OP;
+        return true;
+    }
+
+    _offset = _le32(_args);
+    _remaining = _le32(_args + 4);
+    if (_offset > _sourceSize || _remaining > _sourceSize - _offset)
+    {
+        ESP_LOGE(TAG, "Patch record outside of the source image");
+        return false;
+    }
+
+    if (_op == 'C')
+    {
+        _state = PATCH_OP;
+        return _copy();
+    }
+    _state = _remaining > 0 ? PATCH_ADD : PATCH_OP;
+    return true;
+}
+
+// A copy record needs no input, it is written out right away
+bool esp32FOTAGSMPatcher::_copy()
+{
+    while (_remaining > 0)
+    {
+        size_t n = _remaining > DELTA_BUFFER_SIZE ? DELTA_BUFFER_SIZE : _remaining;
+        if (esp_partition_read(_source, _offset, _buffer, n) != ESP_OK || !_emit(_buffer, n))
+        {
+            return false;
+        }
+        _offset += n;
+        _remaining -= n;
+    }
+    return true;
+}
+
+bool esp32FOTAGSMPatcher::_emit(uint8_t *data, size_t length)
+{
+    if (_outputSize + length > _targetSize)
+    {
+        ESP_LOGE(TAG, "Patch output is larger than its target size");
+        return false;
+    }
+    if (_output(data, length) != length)
+    {
+        ESP_LOGE(TAG, "Patched data could not be written");
+        return false;
+    }
+    _outputSize += length;
+    return true;
+}
+
+// Apply the next patch bytes.
+// Returns false if the patch is corrupt, does not match the running firmware or
+// the output did not take all bytes.
+bool esp32FOTAGSMPatcher::write(const uint8_t *data, size_t length)
+{
+    if (!isActive() || _failed)
+    {
+        return false;
+    }
+
+    while (length > 0 && !_failed)
+    {
+        size_t n = 0;
+
+        switch (_state)
+        {
+        case PATCH_HEADER:
+            while (length > 0 && _count < DELTA_HEADER_SIZE)
+            {
+                _header[_count++] = *data++;
+                length--;
+            }
+            if (_count == DELTA_HEADER_SIZE)
+            {
+                _failed = !_checkHeader();
+                _state = PATCH_OP;
+            }
+            break;
+        case PATCH_OP:
+            _op = *data++;
+            length--;
+            _count = 0;
+            _argsSize = _op == 'I' ? 4 : 8;
+            if (_op == 'E')
+            {
+                _state = PATCH_END;
+            }
+            else if (_op == 'C' || _op == 'A' || _op == 'I')
+            {
+                _state = PATCH_ARGS;
+            }
+            else
+            {
+                ESP_LOGE(TAG, "Unknown patch record 0x%02x", _op);
+                _failed = true;
+            }
+            break;
+        case PATCH_ARGS:
+            while (length > 0 && _count < _argsSize)
+            {
+                _args[_count++] = *data++;
+                length--;
+            }
+            if (_count == _argsSize)
+            {
+                _failed = !_startRecord();
+            }
+            break;
+        case PATCH_ADD:
+        case PATCH_INSERT:
+            n = _remaining;
+            if (n > length)
+            {
+                n = length;
+            }
+            if (n > DELTA_BUFFER_SIZE)
+            {
+                n = DELTA_BUFFER_SIZE;
+            }
+
+            if (_state == PATCH_ADD)
+            {
+                if (esp_partition_read(_source, _offset, _buffer, n) != ESP_OK)
+                {
+                    _failed = true;
+                    break;
+                }
+                for (size_t i = 0; i < n; i++)
+                {
+                    _buffer[i] += data[i];
+                }
+                _offset += n;
+            }
+            else
+            {
+                memcpy(_buffer, data, n);
+            }
+
+            _failed = !_emit(_buffer, n);
+            data += n;
+            length -= n;
+            _remaining -= n;
+            if (_remaining == 0)
+            {
+                _state = PATCH_OP;
+            }
+            break;
+        case PATCH_END:
+            ESP_LOGE(TAG, "Data after the end of the patch");
+            _failed = true;
+            break;
+        }
+    }
+    return !_failed;
+}
+
+// True if the whole patch was applied and produced the target size
+bool esp32FOTAGSMPatcher::end()
+{
+    if (!isActive() || _failed || _state != PATCH_END || _outputSize != _targetSize)
+    {
+        ESP_LOGE(TAG, "Patch incomplete, %u of %u bytes rebuilt", _outputSize, _targetSize);
+        return false;
+    }
+    return true;
+}
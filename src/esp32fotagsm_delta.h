@@ -0,0 +1,83 @@
+/*
+   esp32 firmware OTA
+   Purpose: Apply a binary patch against the running firmware
+*/
+
+#ifndef esp32FOTAGSMPatcher_h
+#define esp32FOTAGSMPatcher_h
+
+#include "Arduino.h"
+#include <functional>
+#include <esp_partition.h>
+
+#define DELTA_MAGIC "FDP1"
+#define DELTA_HEADER_SIZE (28)
+#define DELTA_BUFFER_SIZE (1024)
+
+// Rebuilds a new image from the running app partition and a streamed patch, as
+// produced by tools/fotagsm_delta.py. All values are little endian:
+//
+//   header  "FDP1", uint32 source size, 16 byte source MD5, uint32 target size
+//   'C'     uint32 offset, uint32 length     copy bytes of the running image
+//   'A'     uint32 offset, uint32 length,    add each byte to the byte of the
+//           length bytes                     running image at the same position
+//   'I'     uint32 length, length bytes      insert new bytes
+//   'E'                                      end of patch
+//
+// The source MD5 is checked against the running partition before any output is
+// produced, so a patch made for another version fails before the flash is touched.
+class esp32FOTAGSMPatcher
+{
+public:
+  // Receives the rebuilt image bytes, returns how many were written
+  typedef std::function<size_t(uint8_t *data, size_t length)> TOutputFunction;
+
+  esp32FOTAGSMPatcher();
+  ~esp32FOTAGSMPatcher();
+
+  bool begin(TOutputFunction output);
+  bool write(const uint8_t *data, size_t length);
+  bool end();
+  void release();
+
+  bool isActive();
+  size_t outputSize();
+
+private:
+  enum PatchState
+  {
+    PATCH_HEADER,
+    PATCH_OP,
+    PATCH_ARGS,
+    PATCH_ADD,
+    PATCH_INSERT,
+    PATCH_END
+  };
+
+  bool _checkHeader();
+  bool _checkSource();
+  bool _startRecord();
+  bool _copy();
+  bool _emit(uint8_t *data, size_t length);
+  static uint32_t _le32(const uint8_t *data);
+
+  const esp_partition_t *_source;
+  TOutputFunction _output;
+  uint8_t *_buffer;
+  bool _failed;
+
+  PatchState _state;
+  uint8_t _header[DELTA_HEADER_SIZE];
+  size_t _count;
+  uint8_t _op;
+  uint8_t _args[8];
+  size_t _argsSize;
+
+  uint32_t _sourceSize;
+  uint32_t _targetSize;
+  uint32_t _offset;
+  uint32_t _remaining;
+  size_t _outputSize;
+};
+
+#endif
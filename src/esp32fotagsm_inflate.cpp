@@ -0,0 +1,368 @@
+/*
+   esp32 firmware OTA
+   Purpose: Streaming gzip / zlib decompression of firmware images
+*/
+
+#include "esp32fotagsm_inflate.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#if CONFIG_IDF_TARGET_ESP32S2
+#include "esp32s2/rom/miniz.h"
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/miniz.h"
+#elif CONFIG_IDF_TARGET_ESP32C3
+#include "esp32c3/rom/miniz.h"
+#else
+#include "esp32/rom/miniz.h"
+#endif
+
+#define GZIP_FLAG_HCRC (0x02)
+#define GZIP_FLAG_EXTRA (0x04)
+#define GZIP_FLAG_NAME (0x08)
+#define GZIP_FLAG_COMMENT (0x10)
+
+esp32FOTAGSMInflater::esp32FOTAGSMInflater()
+    : _format(FORMAT_NONE),
+      _output(NULL),
+      _usePSRAM(true),
+      _decompressor(NULL),
+      _dict(NULL),
+      _dictOffset(0),
+      _outputSize(0),
+      _streamDone(false),
+      _failed(false),
+      _gzipState(GZIP_DONE),
+      _gzipFlags(0),
+      _gzipCount(0),
+      _gzipSkip(0),
+      _gzipTrailerCount(0)
+{
+}
+
+esp32FOTAGSMInflater::~esp32FOTAGSMInflater()
+{
+    release();
+}
+
+// RAM that begin() allocates: the decompressor state and the deflate window
+size_t esp32FOTAGSMInflater::memoryNeeded()
+{
+    return sizeof(tinfl_decompressor) + TINFL_LZ_DICT_SIZE;
+}
+
+// "gzip" / "deflate" as used in Content-Encoding and the manifest
+esp32FOTAGSMInflater::Format esp32FOTAGSMInflater::formatFromName(const char *name)
+{
+    if (name == NULL)
+    {
+        return FORMAT_NONE;
+    }
+    if (strcasecmp(name, "gzip") == 0 || strcasecmp(name, "x-gzip") == 0)
+    {
+        return FORMAT_GZIP;
+    }
+    if (strcasecmp(name, "deflate") == 0 || strcasecmp(name, "zlib") == 0)
+    {
+        return FORMAT_DEFLATE;
+    }
+    return FORMAT_NONE;
+}
+
+void *esp32FOTAGSMInflater::_alloc(size_t size)
+{
+    void *buffer = NULL;
+    if (_usePSRAM && psramFound())
+    {
+        buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (buffer == NULL)
+    {
+        buffer = malloc(size);
+    }
+    return buffer;
+}
+
+bool esp32FOTAGSMInflater::begin(Format format, TOutputFunction output, bool usePSRAM)
+{
+    release();
+
+    if (format == FORMAT_NONE || output == NULL)
+    {
+        return false;
+    }
+
+    _usePSRAM = usePSRAM;
+    _decompressor = _alloc(sizeof(tinfl_decompressor));
+    _dict = (uint8_t *)_alloc(TINFL_LZ_DICT_SIZE);
+    if (_decompressor == NULL || _dict == NULL)
+    {
+        ESP_LOGE(TAG, "Not enough memory for the decompressor");
+        release();
+        return false;
+    }
+
+    tinfl_init((tinfl_decompressor *)_decompressor);
+    _format = format;
+    _output = output;
+    _dictOffset = 0;
+    _outputSize = 0;
+    _streamDone = false;
+    _failed = false;
+    _gzipState = format == FORMAT_GZIP ? GZIP_FIXED : GZIP_DONE;
+    _gzipCount = 0;
+    _gzipSkip = 0;
+    _gzipTrailerCount = 0;
+    return true;
+}
+
+void esp32FOTAGSMInflater::release()
+{
+    free(_decompressor);
+    free(_dict);
+    _decompressor = NULL;
+    _dict = NULL;
+    _format = FORMAT_NONE;
+    _output = NULL;
+}
+
+bool esp32FOTAGSMInflater::isActive()
+{
+    return _format != FORMAT_NONE;
+}
+
+// Number of decompressed bytes handed to the output so far
+size_t esp32FOTAGSMInflater::outputSize()
+{
+    return _outputSize;
+}
+
+// Move to the next optional gzip header field present in the flags
+void esp32FOTAGSMInflater::_nextGzipField()
+{
+    switch (_gzipState)
+    {
+    case GZIP_FIXED:
+        if (_gzipFlags & GZIP_FLAG_EXTRA)
+        {
+            _gzipState = GZIP_EXTRA_LEN;
+            _gzipCount = 0;
+            _gzipSkip = 0;
+            return;
+        }
+        // fall through
+    case GZIP_EXTRA_LEN:
+    case GZIP_EXTRA:
+        if (_gzipFlags & GZIP_FLAG_NAME)
+        {
+            _gzipState = GZIP_NAME;
+            return;
+        }
+        // fall through
+    case GZIP_NAME:
+        if (_gzipFlags & GZIP_FLAG_COMMENT)
+        {
+            _gzipState = GZIP_COMMENT;
+            return;
+        }
+        // fall through
+    case GZIP_COMMENT:
+        if (_gzipFlags & GZIP_FLAG_HCRC)
+        {
+            _gzipState = GZIP_HCRC;
+            _gzipSkip = 2;
+            return;
+        }
+        // fall through
+    default:
+        _gzipState = GZIP_DONE;
+    }
+}
+
+// Consume gzip header bytes, returns how many were used
+size_t esp32FOTAGSMInflater::_parseGzipHeader(const uint8_t *data, size_t length)
+{
+    size_t used = 0;
+
+    while (used < length && _gzipState != GZIP_DONE)
+    {
+        uint8_t c = data[used++];
+
+        switch (_gzipState)
+        {
+        case GZIP_FIXED:
+            _gzipHeader[_gzipCount++] = c;
+            if (_gzipCount == sizeof(_gzipHeader))
+            {
+                // magic and the deflate method
+                if (_gzipHeader[0] != 0x1f || _gzipHeader[1] != 0x8b || _gzipHeader[2] != 8)
+                {
+                    ESP_LOGE(TAG, "Not a gzip stream");
+                    _failed = true;
+                    return used;
+                }
+                _gzipFlags = _gzipHeader[3];
+                _nextGzipField();
+            }
+            break;
+        case GZIP_EXTRA_LEN:
+            _gzipSkip |= (size_t)c << (8 * _gzipCount++);
+            if (_gzipCount == 2)
+            {
+                _gzipState = GZIP_EXTRA;
+                if (_gzipSkip == 0)
+                {
+                    _nextGzipField();
+                }
+            }
+            break;
+        case GZIP_EXTRA:
+        case GZIP_HCRC:
+            if (--_gzipSkip == 0)
+            {
+                _nextGzipField();
+            }
+            break;
+        case GZIP_NAME:
+        case GZIP_COMMENT:
+            if (c == 0)
+            {
+                _nextGzipField();
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return used;
+}
+
+// The 8 byte gzip trailer: CRC32 and the uncompressed size (ISIZE).
+// The CRC is not checked, the image MD5 covers the content.
+size_t esp32FOTAGSMInflater::_readGzipTrailer(const uint8_t *data, size_t length)
+{
+    size_t used = 0;
+    while (used < length && _gzipTrailerCount < sizeof(_gzipTrailer))
+    {
+        _gzipTrailer[_gzipTrailerCount++] = data[used++];
+    }
+    return used;
+}
+
+// The ROM inflater reads ahead of the deflate stream and does not give the
+// bytes back. Past the padding of the last byte, whole bytes still in its bit
+// buffer are the start of the trailer.
+void esp32FOTAGSMInflater::_recoverGzipTrailer()
+{
+    tinfl_decompressor *decompressor = (tinfl_decompressor *)_decompressor;
+    mz_uint32 bits = decompressor->m_num_bits;
+    tinfl_bit_buf_t buffer = decompressor->m_bit_buf >> (bits & 7);
+
+    for (bits -= bits & 7; bits >= 8 && _gzipTrailerCount < sizeof(_gzipTrailer); bits -= 8)
+    {
+        _gzipTrailer[_gzipTrailerCount++] = buffer & 0xff;
+        buffer >>= 8;
+    }
+    decompressor->m_num_bits = bits;
+}
+
+// Decompress the next compressed bytes into the output.
+// Returns false if the stream is corrupt or the output did not take all bytes.
+bool esp32FOTAGSMInflater::write(const uint8_t *data, size_t length)
+{
+    if (!isActive() || _failed)
+    {
+        return false;
+    }
+
+    if (_gzipState != GZIP_DONE)
+    {
+        size_t used = _parseGzipHeader(data, length);
+        data += used;
+        length -= used;
+        if (_failed)
+        {
+            return false;
+        }
+    }
+
+    tinfl_decompressor *decompressor = (tinfl_decompressor *)_decompressor;
+    mz_uint32 flags = TINFL_FLAG_HAS_MORE_INPUT;
+    if (_format == FORMAT_DEFLATE)
+    {
+        flags |= TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32;
+    }
+
+    tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    while (!_streamDone && (length > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT))
+    {
+        size_t inSize = length;
+        size_t outSize = TINFL_LZ_DICT_SIZE - _dictOffset;
+
+        // the dictionary is used as a circular buffer, it is the deflate window
+        status = tinfl_decompress(decompressor, data, &inSize, _dict, _dict + _dictOffset, &outSize, flags);
+        data += inSize;
+        length -= inSize;
+
+        if (outSize > 0)
+        {
+            if (_output(_dict + _dictOffset, outSize) != outSize)
+            {
+                ESP_LOGE(TAG, "Decompressed data could not be written");
+                _failed = true;
+                return false;
+            }
+            _outputSize += outSize;
+            _dictOffset = (_dictOffset + outSize) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status < TINFL_STATUS_DONE)
+        {
+            ESP_LOGE(TAG, "Decompression failed: %d", status);
+            _failed = true;
+            return false;
+        }
+        if (status == TINFL_STATUS_DONE)
+        {
+            _streamDone = true;
+            if (_format == FORMAT_GZIP)
+            {
+                _recoverGzipTrailer();
+            }
+        }
+    }
+
+    // whatever follows the compressed data is the gzip trailer
+    if (_streamDone && length > 0 && _format == FORMAT_GZIP)
+    {
+        _readGzipTrailer(data, length);
+    }
+    return true;
+}
+
+// True if the whole stream was decompressed and, for gzip, the size in the
+// trailer matches what was written
+bool esp32FOTAGSMInflater::end()
+{
+    if (!isActive() || _failed || !_streamDone)
+    {
+        ESP_LOGE(TAG, "Compressed stream incomplete");
+        return false;
+    }
+
+    if (_format == FORMAT_GZIP)
+    {
+        if (_gzipTrailerCount < sizeof(_gzipTrailer))
+        {
+            ESP_LOGE(TAG, "gzip trailer missing");
+            return false;
+        }
+        uint32_t isize = _gzipTrailer[4] | (_gzipTrailer[5] << 8) | (_gzipTrailer[6] << 16) | ((uint32_t)_gzipTrailer[7] << 24);
+        if (isize != (uint32_t)_outputSize)
+        {
+            ESP_LOGE(TAG, "gzip size %u does not match the %u decompressed bytes", isize, _outputSize);
+            return false;
+        }
+    }
+    return true;
+}
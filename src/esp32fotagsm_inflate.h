@@ -0,0 +1,79 @@
+/*
+   esp32 firmware OTA
+   Purpose: Streaming gzip / zlib decompression of firmware images
+*/
+
+#ifndef esp32FOTAGSMInflater_h
+#define esp32FOTAGSMInflater_h
+
+#include "Arduino.h"
+#include <functional>
+
+// Decompresses an image while it is downloaded, using the inflater in the ESP32
+// ROM. Memory is bounded by the 32 KB deflate window plus the decompressor state,
+// both allocated in begin() and freed in release().
+class esp32FOTAGSMInflater
+{
+public:
+  enum Format
+  {
+    FORMAT_NONE,
+    FORMAT_GZIP,    // gzip file (RFC 1952), e.g. "gzip -9 firmware.bin"
+    FORMAT_DEFLATE  // zlib stream (RFC 1950), HTTP "Content-Encoding: deflate"
+  };
+
+  // Receives the decompressed bytes, returns how many were written
+  typedef std::function<size_t(uint8_t *data, size_t length)> TOutputFunction;
+
+  esp32FOTAGSMInflater();
+  ~esp32FOTAGSMInflater();
+
+  static Format formatFromName(const char *name);
+  static size_t memoryNeeded();
+
+  bool begin(Format format, TOutputFunction output, bool usePSRAM = true);
+  bool write(const uint8_t *data, size_t length);
+  bool end();
+  void release();
+
+  bool isActive();
+  size_t outputSize();
+
+private:
+  enum GzipState
+  {
+    GZIP_FIXED,     // the 10 byte fixed header
+    GZIP_EXTRA_LEN,
+    GZIP_EXTRA,
+    GZIP_NAME,
+    GZIP_COMMENT,
+    GZIP_HCRC,
+    GZIP_DONE
+  };
+
+  size_t _parseGzipHeader(const uint8_t *data, size_t length);
+  void _nextGzipField();
+  size_t _readGzipTrailer(const uint8_t *data, size_t length);
+  void _recoverGzipTrailer();
+  void *_alloc(size_t size);
+
+  Format _format;
+  TOutputFunction _output;
+  bool _usePSRAM;
+  void *_decompressor;
+  uint8_t *_dict;
+  size_t _dictOffset;
+  size_t _outputSize;
+  bool _streamDone;
+  bool _failed;
+
+  GzipState _gzipState;
+  uint8_t _gzipHeader[10];
+  uint8_t _gzipFlags;
+  size_t _gzipCount;
+  size_t _gzipSkip;
+  uint8_t _gzipTrailer[8];
+  size_t _gzipTrailerCount;
+};
+
+#endif
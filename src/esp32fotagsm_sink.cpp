@@ -0,0 +1,176 @@
+/*
+   esp32 firmware OTA
+   Purpose: Destinations for the bytes of an image, Update or user code
+*/
+
+#include "esp32fotagsm_sink.h"
+#include "esp_log.h"
+
+#define FLASH_SECTOR_SIZE (4096)
+
+esp32FOTAGSMUpdateSink::esp32FOTAGSMUpdateSink(int command, const char *label)
+    : _command(command),
+      _label(label),
+      _sizeUnknown(false)
+{
+}
+
+bool esp32FOTAGSMUpdateSink::begin(size_t size)
+{
+    _sizeUnknown = size == UPDATE_SIZE_UNKNOWN;
+    if (!Update.begin(size, _command, -1, LOW, _label))
+    {
+        ESP_LOGD(TAG, "Update.begin() failed. Error #%d: %s", Update.getError(), Update.errorString());
+        return false;
+    }
+    return true;
+}
+
+size_t esp32FOTAGSMUpdateSink::write(uint8_t *data, size_t length)
+{
+    return Update.write(data, length);
+}
+
+// An image of unknown size ends wherever its last byte was written
+bool esp32FOTAGSMUpdateSink::end()
+{
+    if (!Update.end(_sizeUnknown))
+    {
+        ESP_LOGD(TAG, "Error Occurred. Error #%d: %s", Update.getError(), Update.errorString());
+        return false;
+    }
+    if (!Update.isFinished())
+    {
+        ESP_LOGD(TAG, "Update not finished? Something went wrong!");
+        return false;
+    }
+    ESP_LOGD(TAG, "Update MD5: %s", Update.md5String().c_str());
+    return true;
+}
+
+void esp32FOTAGSMUpdateSink::abort()
+{
+    if (Update.isRunning())
+    {
+        Update.abort();
+    }
+}
+
+esp32FOTAGSMStagedSink::esp32FOTAGSMStagedSink(const char *stagingLabel, int command, const char *label)
+    : _stagingLabel(stagingLabel),
+      _command(command),
+      _label(label),
+      _staging(NULL),
+      _written(0),
+      _erased(0),
+      _ended(false)
+{
+}
+
+bool esp32FOTAGSMStagedSink::begin(size_t size)
+{
+    _staging = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _stagingLabel);
+    _written = 0;
+    _erased = 0;
+    _ended = false;
+    if (_staging == NULL)
+    {
+        ESP_LOGE(TAG, "No staging partition %s", _stagingLabel);
+        return false;
+    }
+    if (size != UPDATE_SIZE_UNKNOWN && size > _staging->size)
+    {
+        ESP_LOGE(TAG, "%u bytes do not fit %s (%u bytes)", size, _staging->label, _staging->size);
+        return false;
+    }
+    return true;
+}
+
+// The staging partition and, for a filesystem, the partition Update writes
+bool esp32FOTAGSMStagedSink::fits(size_t size)
+{
+    const esp_partition_t *staging = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _stagingLabel);
+    if (staging == NULL || size > staging->size)
+    {
+        return false;
+    }
+    if (_command != U_SPIFFS)
+    {
+        return true;
+    }
+    const esp_partition_t *destination = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                  _label != NULL ? ESP_PARTITION_SUBTYPE_ANY : ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+                                                                  _label);
+    return destination != NULL && size <= destination->size;
+}
+
+// Sectors are erased as the image reaches them
+size_t esp32FOTAGSMStagedSink::write(uint8_t *data, size_t length)
+{
+    if (_staging == NULL || _ended || _written + length > _staging->size)
+    {
+        return 0;
+    }
+    if (_written + length > _erased)
+    {
+        size_t eraseEnd = (_written + length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+        if (esp_partition_erase_range(_staging, _erased, eraseEnd - _erased) != ESP_OK)
+        {
+            return 0;
+        }
+        _erased = eraseEnd;
+    }
+    if (esp_partition_write(_staging, _written, data, length) != ESP_OK)
+    {
+        return 0;
+    }
+    _written += length;
+    return length;
+}
+
+// The library checked the image, it only has to be copied in commit()
+bool esp32FOTAGSMStagedSink::end()
+{
+    _ended = _staging != NULL && _written > 0;
+    return _ended;
+}
+
+// Copy the staged image with Update. The destination is written in place, a
+// commit that fails part way leaves it incomplete.
+bool esp32FOTAGSMStagedSink::commit()
+{
+    if (!_ended)
+    {
+        return false;
+    }
+    _ended = false;
+
+    if (!Update.begin(_written, _command, -1, LOW, _label))
+    {
+        ESP_LOGE(TAG, "Update.begin() failed. Error #%d: %s", Update.getError(), Update.errorString());
+        return false;
+    }
+    for (size_t offset = 0; offset < _written; offset += STAGED_SINK_COPY_SIZE)
+    {
+        size_t length = _written - offset < STAGED_SINK_COPY_SIZE ? _written - offset : STAGED_SINK_COPY_SIZE;
+        if (esp_partition_read(_staging, offset, _buffer, length) != ESP_OK ||
+            Update.write(_buffer, length) != length)
+        {
+            ESP_LOGE(TAG, "Copying %s failed at byte %u", _staging->label, offset);
+            Update.abort();
+            return false;
+        }
+    }
+    if (!Update.end() || !Update.isFinished())
+    {
+        ESP_LOGE(TAG, "Update.end() failed. Error #%d: %s", Update.getError(), Update.errorString());
+        return false;
+    }
+    return true;
+}
+
+// The staged copy is only overwritten by the next begin()
+void esp32FOTAGSMStagedSink::abort()
+{
+    _ended = false;
+}
@@ -0,0 +1,91 @@
+/*
+   esp32 firmware OTA
+   Purpose: Destinations for the bytes of an image, Update or user code
+*/
+
+#ifndef esp32FOTAGSMSink_h
+#define esp32FOTAGSMSink_h
+
+#include "Arduino.h"
+#include <Update.h>
+#include <esp_partition.h>
+
+#define STAGED_SINK_COPY_SIZE (1024)
+
+// Receives an image as it is downloaded, decompressed or patched. The library
+// checks the MD5, the SHA-256 and the signature before end(), so a sink only
+// needs to store the bytes, e.g. in an external SPI flash, on an SD card or
+// over a UART to a co-processor.
+class esp32FOTAGSMSink
+{
+public:
+  virtual ~esp32FOTAGSMSink() {}
+
+  // Start an image of size bytes, UPDATE_SIZE_UNKNOWN if it is only known at the end
+  virtual bool begin(size_t size) = 0;
+  // Store the next bytes, returns how many were taken
+  virtual size_t write(uint8_t *data, size_t length) = 0;
+  // After the last byte, false if the image cannot be used
+  virtual bool end() = 0;
+  // Make an ended image active, called once all images of an update ended. For
+  // the application image after the targets.
+  virtual bool commit() { return true; }
+  // False if write() or end() already change the live image, such a sink
+  // cannot be a target of a multi-target update
+  virtual bool isStaged() { return true; }
+  // For the preflight check, before anything is downloaded: whether an image
+  // of size bytes fits (true if the sink cannot tell), and the RAM begin()
+  // allocates until commit() or abort()
+  virtual bool fits(size_t size) { return true; }
+  virtual size_t memoryNeeded() { return 0; }
+  // Drop an image after a failure, also called when begin() was not
+  virtual void abort() = 0;
+};
+
+// Writes with the Update library: U_FLASH makes the image the next boot
+// partition in end(), U_SPIFFS writes a filesystem image (optionally into the
+// data partition with this label) in place.
+class esp32FOTAGSMUpdateSink : public esp32FOTAGSMSink
+{
+public:
+  esp32FOTAGSMUpdateSink(int command = U_FLASH, const char *label = NULL);
+
+  bool begin(size_t size);
+  size_t write(uint8_t *data, size_t length);
+  bool end();
+  void abort();
+  bool isStaged() { return false; }
+
+private:
+  int _command;
+  const char *_label;
+  bool _sizeUnknown;
+};
+
+// Keeps the image in a spare data partition (stagingLabel) and writes it with
+// Update only in commit(), e.g. a filesystem image as a target that is not
+// touched before the application image is installed as well
+class esp32FOTAGSMStagedSink : public esp32FOTAGSMSink
+{
+public:
+  esp32FOTAGSMStagedSink(const char *stagingLabel, int command = U_SPIFFS, const char *label = NULL);
+
+  bool begin(size_t size);
+  size_t write(uint8_t *data, size_t length);
+  bool end();
+  bool commit();
+  void abort();
+  bool fits(size_t size);
+
+private:
+  const char *_stagingLabel;
+  int _command;
+  const char *_label;
+  const esp_partition_t *_staging;
+  size_t _written;
+  size_t _erased;
+  bool _ended;
+  uint8_t _buffer[STAGED_SINK_COPY_SIZE];
+};
+
+#endif
@@ -0,0 +1,403 @@
+/*
+   esp32 firmware OTA
+   Purpose: TLS over any Arduino Client, with session resumption
+*/
+
+#include "esp32fotagsm_tls.h"
+#include "esp_log.h"
+
+#define TLS_POLL_MS (10)
+
+esp32FOTAGSMSecureClient::esp32FOTAGSMSecureClient(Client &transport)
+    : _transport(transport),
+      _seeded(false),
+      _configured(false),
+      _insecure(false),
+      _haveCA(false),
+      _handshakeTimeoutMs(TLS_HANDSHAKE_TIMEOUT_MS),
+      _connected(false),
+      _peerClosed(false),
+      _peek(-1),
+      _haveSession(false),
+      _sessionPort(0)
+{
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_x509_crt_init(&_ca);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_session_init(&_session);
+}
+
+esp32FOTAGSMSecureClient::~esp32FOTAGSMSecureClient()
+{
+    stop();
+    mbedtls_ssl_session_free(&_session);
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+// PEM root certificate(s) the server certificate must chain to
+bool esp32FOTAGSMSecureClient::setCACert(const char *rootCAPem)
+{
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_x509_crt_init(&_ca);
+    int err = mbedtls_x509_crt_parse(&_ca, (const unsigned char *)rootCAPem, strlen(rootCAPem) + 1);
+    if (err != 0)
+    {
+        ESP_LOGE(TAG, "Could not parse the CA certificate: -0x%04x", -err);
+        _haveCA = false;
+        return false;
+    }
+    _haveCA = true;
+    _configured = false;
+    return true;
+}
+
+// Encrypt without checking the server certificate, for testing only
+void esp32FOTAGSMSecureClient::setInsecure()
+{
+    _insecure = true;
+    _configured = false;
+}
+
+void esp32FOTAGSMSecureClient::setHandshakeTimeout(unsigned long timeoutMs)
+{
+    _handshakeTimeoutMs = timeoutMs;
+}
+
+// Forget the saved session, the next connect does a full handshake
+void esp32FOTAGSMSecureClient::clearSession()
+{
+    mbedtls_ssl_session_free(&_session);
+    mbedtls_ssl_session_init(&_session);
+    _haveSession = false;
+}
+
+bool esp32FOTAGSMSecureClient::_setup()
+{
+    if (_configured)
+    {
+        return true;
+    }
+    if (!_haveCA && !_insecure)
+    {
+        ESP_LOGE(TAG, "No CA certificate set, call setCACert() or setInsecure()");
+        return false;
+    }
+
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_ssl_config_init(&_conf);
+
+    // the generator is seeded once, a new certificate only changes the config
+    int err = 0;
+    if (!_seeded)
+    {
+        const char *personalization = "esp32FOTAGSM";
+        err = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy,
+                                    (const unsigned char *)personalization, strlen(personalization));
+        _seeded = err == 0;
+    }
+    if (err == 0)
+    {
+        err = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (err != 0)
+    {
+        ESP_LOGE(TAG, "TLS setup failed: -0x%04x", -err);
+        return false;
+    }
+
+    mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+    if (_haveCA)
+    {
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&_conf, &_ca, NULL);
+    }
+    else
+    {
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    // a ticket lets the server resume without keeping a session cache
+    mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+    _configured = true;
+    return true;
+}
+
+int esp32FOTAGSMSecureClient::_bioSend(void *ctx, const unsigned char *buf, size_t len)
+{
+    Client *transport = static_cast<Client *>(ctx);
+    if (!transport->connected())
+    {
+        return MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    size_t written = transport->write(buf, len);
+    return written > 0 ? (int)written : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+// Never blocks, mbedtls is called again once the transport has data
+int esp32FOTAGSMSecureClient::_bioRecv(void *ctx, unsigned char *buf, size_t len)
+{
+    Client *transport = static_cast<Client *>(ctx);
+    int available = transport->available();
+    if (available <= 0)
+    {
+        return transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    if ((size_t)available < len)
+    {
+        len = available;
+    }
+    int received = transport->read(buf, len);
+    return received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+bool esp32FOTAGSMSecureClient::_handshake(unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    int err;
+    while ((err = mbedtls_ssl_handshake(&_ssl)) != 0)
+    {
+        if (err != MBEDTLS_ERR_SSL_WANT_READ && err != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            ESP_LOGE(TAG, "TLS handshake failed: -0x%04x", -err);
+            return false;
+        }
+        if (millis() - start > timeoutMs)
+        {
+            ESP_LOGE(TAG, "TLS handshake timed out");
+            return false;
+        }
+        delay(TLS_POLL_MS);
+    }
+    ESP_LOGD(TAG, "TLS handshake done in %lu ms", millis() - start);
+    return true;
+}
+
+int esp32FOTAGSMSecureClient::connect(const char *host, uint16_t port)
+{
+    return _connect(host, port, _handshakeTimeoutMs);
+}
+
+// The handshake gives up after timeoutMs
+int esp32FOTAGSMSecureClient::_connect(const char *host, uint16_t port, unsigned long timeoutMs)
+{
+    stop();
+    if (!_setup() || !_transport.connect(host, port))
+    {
+        return 0;
+    }
+
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_init(&_ssl);
+    if (mbedtls_ssl_setup(&_ssl, &_conf) != 0 || mbedtls_ssl_set_hostname(&_ssl, host) != 0)
+    {
+        ESP_LOGE(TAG, "TLS setup failed");
+        _transport.stop();
+        return 0;
+    }
+    mbedtls_ssl_set_bio(&_ssl, &_transport, _bioSend, _bioRecv, NULL);
+
+    // offer the last session to the same server
+    if (_haveSession && _sessionHost == host && _sessionPort == port)
+    {
+        ESP_LOGD(TAG, "Resuming the TLS session with %s", host);
+        mbedtls_ssl_set_session(&_ssl, &_session);
+    }
+
+    if (!_handshake(timeoutMs))
+    {
+        // a session the server refused to resume is not offered again
+        clearSession();
+        mbedtls_ssl_free(&_ssl);
+        mbedtls_ssl_init(&_ssl);
+        _transport.stop();
+        return 0;
+    }
+
+    // keep the (possibly new) session and ticket for the next connect
+    mbedtls_ssl_session_free(&_session);
+    mbedtls_ssl_session_init(&_session);
+    _haveSession = mbedtls_ssl_get_session(&_ssl, &_session) == 0;
+    _sessionHost = host;
+    _sessionPort = port;
+
+    _connected = true;
+    _peerClosed = false;
+    _peek = -1;
+    return 1;
+}
+
+// The certificate is checked against the name, an IP only works with setInsecure()
+int esp32FOTAGSMSecureClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+// timeout in ms, instead of the handshake timeout for this connection
+int esp32FOTAGSMSecureClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+    return connect(ip.toString().c_str(), port, timeout);
+}
+
+int esp32FOTAGSMSecureClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+    return _connect(host, port, timeout > 0 ? (unsigned long)timeout : _handshakeTimeoutMs);
+}
+
+size_t esp32FOTAGSMSecureClient::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+size_t esp32FOTAGSMSecureClient::write(const uint8_t *buf, size_t size)
+{
+    size_t written = 0;
+    unsigned long start = millis();
+
+    while (_connected && written < size)
+    {
+        int n = mbedtls_ssl_write(&_ssl, buf + written, size - written);
+        if (n > 0)
+        {
+            written += n;
+            start = millis();
+        }
+        else if ((n != MBEDTLS_ERR_SSL_WANT_READ && n != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+                 millis() - start > _handshakeTimeoutMs)
+        {
+            ESP_LOGE(TAG, "TLS write failed: -0x%04x", -n);
+            break;
+        }
+        else
+        {
+            delay(TLS_POLL_MS);
+        }
+    }
+    return written;
+}
+
+// Decrypted bytes ready to be read, records that already arrived are decrypted
+int esp32FOTAGSMSecureClient::available()
+{
+    if (!_connected)
+    {
+        return 0;
+    }
+
+    int pending = _peek >= 0 ? 1 : 0;
+    if (mbedtls_ssl_get_bytes_avail(&_ssl) == 0 && !_peerClosed && _transport.available() > 0)
+    {
+        // a zero length read only processes the next record
+        unsigned char none;
+        int err = mbedtls_ssl_read(&_ssl, &none, 0);
+        if (err == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || err == MBEDTLS_ERR_SSL_CONN_EOF)
+        {
+            _peerClosed = true;
+        }
+    }
+    return mbedtls_ssl_get_bytes_avail(&_ssl) + pending;
+}
+
+int esp32FOTAGSMSecureClient::read()
+{
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int esp32FOTAGSMSecureClient::read(uint8_t *buf, size_t size)
+{
+    if (!_connected || size == 0)
+    {
+        return -1;
+    }
+
+    size_t received = 0;
+    if (_peek >= 0)
+    {
+        buf[received++] = _peek;
+        _peek = -1;
+        if (received == size)
+        {
+            return received;
+        }
+    }
+
+    if (_peerClosed || (mbedtls_ssl_get_bytes_avail(&_ssl) == 0 && _transport.available() <= 0))
+    {
+        return received > 0 ? (int)received : -1;
+    }
+
+    int n = mbedtls_ssl_read(&_ssl, buf + received, size - received);
+    if (n > 0)
+    {
+        received += n;
+    }
+    else if (n == 0 || n == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || n == MBEDTLS_ERR_SSL_CONN_EOF)
+    {
+        _peerClosed = true;
+    }
+    return received > 0 ? (int)received : -1;
+}
+
+int esp32FOTAGSMSecureClient::peek()
+{
+    if (_peek < 0)
+    {
+        uint8_t c;
+        if (read(&c, 1) == 1)
+        {
+            _peek = c;
+        }
+    }
+    return _peek;
+}
+
+// Drop the decrypted bytes not read yet. The encrypted stream itself cannot be
+// flushed without breaking the record layer.
+void esp32FOTAGSMSecureClient::flush()
+{
+    uint8_t buf[64];
+    while (available() > 0 && read(buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+// Close the connection, the session is kept for the next connect()
+void esp32FOTAGSMSecureClient::stop()
+{
+    if (_connected)
+    {
+        if (!_peerClosed && _transport.connected())
+        {
+            mbedtls_ssl_close_notify(&_ssl);
+        }
+        mbedtls_ssl_free(&_ssl);
+        mbedtls_ssl_init(&_ssl);
+        _connected = false;
+    }
+    _peek = -1;
+    _transport.stop();
+}
+
+uint8_t esp32FOTAGSMSecureClient::connected()
+{
+    if (!_connected)
+    {
+        return 0;
+    }
+    if (available() > 0)
+    {
+        return 1;
+    }
+    return !_peerClosed && _transport.connected();
+}
+
+esp32FOTAGSMSecureClient::operator bool()
+{
+    return connected();
+}
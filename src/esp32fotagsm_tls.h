@@ -0,0 +1,81 @@
+/*
+   esp32 firmware OTA
+   Purpose: TLS over any Arduino Client, with session resumption
+*/
+
+#ifndef esp32FOTAGSMSecureClient_h
+#define esp32FOTAGSMSecureClient_h
+
+#include "Arduino.h"
+#include <Client.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/x509_crt.h>
+
+#define TLS_HANDSHAKE_TIMEOUT_MS (60000)
+// Stack the task calling connect() needs for a full handshake with certificate
+// checks, e.g. startOTA(1, TLS_TASK_STACK_SIZE). The 8 KB default is not enough.
+#define TLS_TASK_STACK_SIZE (16384)
+
+// Runs TLS with mbedtls on top of another Client, e.g. a TinyGsmClient.
+// The session of the last connection is kept after stop(), so reconnecting to
+// the same host resumes it (session ticket or ID) with an abbreviated
+// handshake instead of a full one with certificate checks and key exchange.
+class esp32FOTAGSMSecureClient : public Client
+{
+public:
+  esp32FOTAGSMSecureClient(Client &transport);
+  ~esp32FOTAGSMSecureClient();
+
+  bool setCACert(const char *rootCAPem);
+  void setInsecure();
+  void setHandshakeTimeout(unsigned long timeoutMs);
+  void clearSession();
+
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  int connect(IPAddress ip, uint16_t port, int32_t timeout);
+  int connect(const char *host, uint16_t port, int32_t timeout);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buf, size_t size);
+  int peek();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool();
+
+private:
+  bool _setup();
+  bool _handshake(unsigned long timeoutMs);
+  int _connect(const char *host, uint16_t port, unsigned long timeoutMs);
+  static int _bioSend(void *ctx, const unsigned char *buf, size_t len);
+  static int _bioRecv(void *ctx, unsigned char *buf, size_t len);
+
+  Client &_transport;
+  bool _seeded;
+  bool _configured;
+  bool _insecure;
+  bool _haveCA;
+  unsigned long _handshakeTimeoutMs;
+
+  mbedtls_entropy_context _entropy;
+  mbedtls_ctr_drbg_context _drbg;
+  mbedtls_x509_crt _ca;
+  mbedtls_ssl_config _conf;
+  mbedtls_ssl_context _ssl;
+
+  bool _connected;
+  bool _peerClosed;
+  int _peek;
+
+  mbedtls_ssl_session _session;
+  bool _haveSession;
+  String _sessionHost;
+  uint16_t _sessionPort;
+};
+
+#endif
@@ -0,0 +1,306 @@
+/*
+   esp32 firmware OTA
+   Purpose: SHA-256, per block hashes and signature check of firmware images
+*/
+
+#include "esp32fotagsm_verify.h"
+#include "esp_log.h"
+#include <mbedtls/version.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/base64.h>
+
+// The _ret variants are the only ones returning errors before mbedtls 3
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+#define sha256Starts(ctx) mbedtls_sha256_starts_ret(ctx, 0)
+#define sha256Update(ctx, data, length) mbedtls_sha256_update_ret(ctx, data, length)
+#define sha256Finish(ctx, digest) mbedtls_sha256_finish_ret(ctx, digest)
+#else
+#define sha256Starts(ctx) mbedtls_sha256_starts(ctx, 0)
+#define sha256Update(ctx, data, length) mbedtls_sha256_update(ctx, data, length)
+#define sha256Finish(ctx, digest) mbedtls_sha256_finish(ctx, digest)
+#endif
+
+#define SIGNATURE_MAX_SIZE (512)
+#define PARTITION_READ_SIZE (512)
+
+esp32FOTAGSMVerifier::esp32FOTAGSMVerifier()
+    : _hashing(false),
+      _finished(false),
+      _blockHashes(NULL),
+      _blockCount(0),
+      _blockSize(0),
+      _blockImageSize(0),
+      _blockPos(0),
+      _blockSkip(0)
+{
+    mbedtls_sha256_init(&_imageCtx);
+    mbedtls_sha256_init(&_blockCtx);
+}
+
+esp32FOTAGSMVerifier::~esp32FOTAGSMVerifier()
+{
+    release();
+    mbedtls_sha256_free(&_imageCtx);
+    mbedtls_sha256_free(&_blockCtx);
+}
+
+static bool parseHex(const char *hex, uint8_t *out, size_t size)
+{
+    if (strlen(hex) != 2 * size)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+        char *end;
+        out[i] = strtoul(byte, &end, 16);
+        if (*end != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Start hashing a new image. With an expected SHA-256 in hex finish() compares
+// against it, without one the digest is only available for a signature check.
+bool esp32FOTAGSMVerifier::begin(const char *sha256Hex)
+{
+    _hashing = true;
+    _finished = false;
+    memset(_expected, 0, sizeof(_expected));
+
+    if (sha256Hex != NULL && sha256Hex[0] != 0 && !parseHex(sha256Hex, _expected, sizeof(_expected)))
+    {
+        ESP_LOGE(TAG, "Malformed sha256 in the manifest");
+        _hashing = false;
+        return false;
+    }
+    sha256Starts(&_imageCtx);
+    return true;
+}
+
+void esp32FOTAGSMVerifier::update(const uint8_t *data, size_t length)
+{
+    if (_hashing && !_finished)
+    {
+        sha256Update(&_imageCtx, data, length);
+    }
+}
+
+// Hash the first length bytes already in the partition, for a resumed download
+bool esp32FOTAGSMVerifier::updateFromPartition(const esp_partition_t *partition, size_t length)
+{
+    uint8_t buffer[PARTITION_READ_SIZE];
+
+    for (size_t offset = 0; offset < length && _hashing; offset += sizeof(buffer))
+    {
+        size_t n = length - offset < sizeof(buffer) ? length - offset : sizeof(buffer);
+        if (esp_partition_read(partition, offset, buffer, n) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Reading the partial image failed");
+            return false;
+        }
+        update(buffer, n);
+    }
+    return true;
+}
+
+bool esp32FOTAGSMVerifier::isHashing()
+{
+    return _hashing;
+}
+
+// Finish the image hash, false if it does not match the expected one
+bool esp32FOTAGSMVerifier::finish()
+{
+    if (!_hashing)
+    {
+        return true;
+    }
+    if (!_finished)
+    {
+        sha256Finish(&_imageCtx, _digest);
+        _finished = true;
+    }
+
+    uint8_t none[SHA256_SIZE] = {0};
+    if (memcmp(_expected, none, sizeof(none)) != 0 && memcmp(_expected, _digest, sizeof(_digest)) != 0)
+    {
+        ESP_LOGE(TAG, "SHA-256 of the image does not match the manifest");
+        return false;
+    }
+    return true;
+}
+
+// Check a base64 RSA or ECDSA signature of the image SHA-256, after finish()
+bool esp32FOTAGSMVerifier::verifySignature(const char *publicKeyPem, const char *signatureBase64)
+{
+    if (!_finished)
+    {
+        return false;
+    }
+
+    uint8_t signature[SIGNATURE_MAX_SIZE];
+    size_t signatureSize = 0;
+    if (mbedtls_base64_decode(signature, sizeof(signature), &signatureSize,
+                              (const unsigned char *)signatureBase64, strlen(signatureBase64)) != 0 ||
+        signatureSize == 0)
+    {
+        ESP_LOGE(TAG, "Malformed image signature");
+        return false;
+    }
+
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    int err = mbedtls_pk_parse_public_key(&pk, (const unsigned char *)publicKeyPem, strlen(publicKeyPem) + 1);
+    if (err == 0)
+    {
+        err = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, _digest, sizeof(_digest), signature, signatureSize);
+        if (err != 0)
+        {
+            ESP_LOGE(TAG, "Image signature is not valid: -0x%04x", -err);
+        }
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Could not parse the public key: -0x%04x", -err);
+    }
+    mbedtls_pk_free(&pk);
+    return err == 0;
+}
+
+// Use count SHA-256 hashes of blockSize byte blocks of an imageSize byte download,
+// the last block may be shorter. Takes ownership of the malloc'ed hashes.
+bool esp32FOTAGSMVerifier::setBlocks(size_t blockSize, size_t imageSize, uint8_t *hashes, size_t count)
+{
+    free(_blockHashes);
+    _blockHashes = NULL;
+    _blockCount = 0;
+
+    if (blockSize == 0 || count != (imageSize + blockSize - 1) / blockSize)
+    {
+        ESP_LOGE(TAG, "%u block hashes do not cover %u bytes in blocks of %u", count, imageSize, blockSize);
+        free(hashes);
+        return false;
+    }
+
+    _blockHashes = hashes;
+    _blockCount = count;
+    _blockSize = blockSize;
+    _blockImageSize = imageSize;
+    _startBlocks(0);
+    return true;
+}
+
+bool esp32FOTAGSMVerifier::hasBlocks()
+{
+    return _blockHashes != NULL;
+}
+
+size_t esp32FOTAGSMVerifier::blockSize()
+{
+    return _blockSize;
+}
+
+// Blocks are checked from the first boundary at or after offset on
+void esp32FOTAGSMVerifier::_startBlocks(size_t offset)
+{
+    _blockPos = offset;
+    _blockSkip = (_blockSize - offset % _blockSize) % _blockSize;
+    if (_blockSkip == 0)
+    {
+        sha256Starts(&_blockCtx);
+    }
+}
+
+// Hash the next downloaded bytes, starting at offset of the download. Nothing
+// is kept from data that contains a corrupt block.
+esp32FOTAGSMVerifier::BlockCheck esp32FOTAGSMVerifier::checkBlocks(size_t offset, const uint8_t *data, size_t length)
+{
+    if (!hasBlocks())
+    {
+        return BLOCK_OK;
+    }
+    if (offset != _blockPos)
+    {
+        _startBlocks(offset);
+    }
+
+    // to go back to if this data is rejected
+    mbedtls_sha256_context saved;
+    mbedtls_sha256_init(&saved);
+    mbedtls_sha256_clone(&saved, &_blockCtx);
+    size_t savedSkip = _blockSkip;
+
+    BlockCheck result = BLOCK_OK;
+    while (length > 0)
+    {
+        size_t n;
+        if (_blockSkip > 0)
+        {
+            n = length < _blockSkip ? length : _blockSkip;
+            _blockSkip -= n;
+            if (_blockSkip == 0)
+            {
+                sha256Starts(&_blockCtx);
+            }
+        }
+        else
+        {
+            size_t index = _blockPos / _blockSize;
+            size_t blockStart = index * _blockSize;
+            size_t blockEnd = blockStart + _blockSize;
+            if (blockEnd > _blockImageSize)
+            {
+                blockEnd = _blockImageSize;
+            }
+            if (index >= _blockCount)
+            {
+                // past the end of the list
+                break;
+            }
+
+            n = blockEnd - _blockPos;
+            if (n > length)
+            {
+                n = length;
+            }
+            sha256Update(&_blockCtx, data, n);
+
+            if (_blockPos + n == blockEnd)
+            {
+                uint8_t digest[SHA256_SIZE];
+                sha256Finish(&_blockCtx, digest);
+                if (memcmp(digest, _blockHashes + index * SHA256_SIZE, SHA256_SIZE) != 0)
+                {
+                    ESP_LOGE(TAG, "Block %u at byte %u is corrupt", index, blockStart);
+                    result = blockStart >= offset ? BLOCK_RETRY : BLOCK_FATAL;
+                    break;
+                }
+                sha256Starts(&_blockCtx);
+            }
+        }
+        data += n;
+        length -= n;
+        _blockPos += n;
+    }
+
+    if (result != BLOCK_OK)
+    {
+        mbedtls_sha256_clone(&_blockCtx, &saved);
+        _blockPos = offset;
+        _blockSkip = savedSkip;
+    }
+    mbedtls_sha256_free(&saved);
+    return result;
+}
+
+void esp32FOTAGSMVerifier::release()
+{
+    free(_blockHashes);
+    _blockHashes = NULL;
+    _blockCount = 0;
+    _hashing = false;
+}
@@ -0,0 +1,63 @@
+/*
+   esp32 firmware OTA
+   Purpose: SHA-256, per block hashes and signature check of firmware images
+*/
+
+#ifndef esp32FOTAGSMVerifier_h
+#define esp32FOTAGSMVerifier_h
+
+#include "Arduino.h"
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+#define SHA256_SIZE (32)
+
+// Hashes an image while it is written. The SHA-256 of the whole image is
+// compared with the manifest and optionally its signature checked. An optional
+// list of SHA-256 hashes of fixed size blocks of the download lets a corrupt
+// block be found as soon as it arrives, before it is written.
+class esp32FOTAGSMVerifier
+{
+public:
+  enum BlockCheck
+  {
+    BLOCK_OK,
+    BLOCK_RETRY, // a block that started in the checked data is corrupt
+    BLOCK_FATAL  // a block that started before it is corrupt and already written
+  };
+
+  esp32FOTAGSMVerifier();
+  ~esp32FOTAGSMVerifier();
+
+  bool begin(const char *sha256Hex);
+  void update(const uint8_t *data, size_t length);
+  bool updateFromPartition(const esp_partition_t *partition, size_t length);
+  bool finish();
+  bool verifySignature(const char *publicKeyPem, const char *signatureBase64);
+  bool isHashing();
+
+  bool setBlocks(size_t blockSize, size_t imageSize, uint8_t *hashes, size_t count);
+  bool hasBlocks();
+  size_t blockSize();
+  BlockCheck checkBlocks(size_t offset, const uint8_t *data, size_t length);
+  void release();
+
+private:
+  void _startBlocks(size_t offset);
+
+  bool _hashing;
+  mbedtls_sha256_context _imageCtx;
+  uint8_t _expected[SHA256_SIZE];
+  uint8_t _digest[SHA256_SIZE];
+  bool _finished;
+
+  uint8_t *_blockHashes;
+  size_t _blockCount;
+  size_t _blockSize;
+  size_t _blockImageSize;
+  mbedtls_sha256_context _blockCtx;
+  size_t _blockPos;
+  size_t _blockSkip;
+};
+
+#endif
@@ -0,0 +1,327 @@
+/*
+   esp32 firmware OTA
+   Purpose: An HTTP server in memory behind the Client interface, optionally
+            with the latency and bandwidth of a modem link, and a sink that
+            keeps the image in RAM, shared by the tests
+*/
+
+#ifndef ESP32FOTAGSM_MOCK_H
+#define ESP32FOTAGSM_MOCK_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include "esp32fotagsm.h"
+
+#define MOCK_MAX_FILES (4)
+#define MOCK_IMAGE_SIZE (16384)
+
+// HEAD, GET and single Range requests of a few files. Any other path is
+// answered with the manifest.
+class MockServer : public Client
+{
+public:
+    int requests;
+    int connects;
+    int rangeRequests;
+    int notModified;
+    // the server announces and honours Range requests
+    bool acceptRanges;
+    // Range requests are answered with 200 and the whole file, like by a proxy
+    bool rangeAnswers200;
+    // this many Range requests get the bytes from one further on
+    int wrongRanges;
+    // this many image bodies end after half their bytes and the connection closes
+    int truncateBodies;
+    // every nth image body is cut the same way, 0 for none
+    int truncateEvery;
+    // the link: time to open a connection, from a request to the first byte of
+    // the response and the bytes per second after it, 0 for no limit
+    unsigned long connectMs;
+    unsigned long latencyMs;
+    unsigned long bytesPerSecond;
+    // bytes of responses sent, headers included
+    size_t bytesSent;
+    // Content-Type of the manifest
+    const char *manifestType;
+    // ETag of the manifest, a matching If-None-Match gets a 304
+    const char *manifestETag;
+
+    MockServer() { clear(); }
+
+    // Forget the files and the counters
+    void clear()
+    {
+        _files = 0;
+        _manifest = "";
+        reset();
+    }
+
+    // Reset the counters and the faults, the files stay
+    void reset()
+    {
+        requests = 0;
+        connects = 0;
+        rangeRequests = 0;
+        notModified = 0;
+        acceptRanges = true;
+        rangeAnswers200 = false;
+        wrongRanges = 0;
+        truncateBodies = 0;
+        truncateEvery = 0;
+        connectMs = 0;
+        latencyMs = 0;
+        bytesPerSecond = 0;
+        bytesSent = 0;
+        _bodies = 0;
+        _readyAt = 0;
+        manifestType = "application/json";
+        manifestETag = NULL;
+        for (int i = 0; i < _files; i++)
+        {
+            _fileRequests[i] = 0;
+        }
+        _open = false;
+        _closeAfterBody = false;
+        _request = "";
+        _response = "";
+        _body = NULL;
+        _bodyLength = 0;
+        _position = 0;
+    }
+
+    void setManifest(const char *manifest) { _manifest = manifest; }
+
+    void addFile(const char *path, const uint8_t *data, size_t size)
+    {
+        _paths[_files] = path;
+        _data[_files] = data;
+        _sizes[_files] = size;
+        _fileRequests[_files] = 0;
+        _files++;
+    }
+
+    // GET and HEAD requests of path so far
+    int requestsFor(const char *path)
+    {
+        for (int i = 0; i < _files; i++)
+        {
+            if (strcmp(_paths[i], path) == 0)
+            {
+                return _fileRequests[i];
+            }
+        }
+        return 0;
+    }
+
+    int connect(IPAddress ip, uint16_t port) { return connect("", port); }
+    int connect(const char *host, uint16_t port)
+    {
+        connects++;
+        if (connectMs > 0)
+        {
+            delay(connectMs);
+        }
+        _open = true;
+        _closeAfterBody = false;
+        _request = "";
+        _response = "";
+        _bodyLength = 0;
+        _position = 0;
+        return 1;
+    }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            _request += (char)buf[i];
+        }
+        if (_request.endsWith("\r\n\r\n"))
+        {
+            _respond();
+            _request = "";
+        }
+        return size;
+    }
+
+    int available()
+    {
+        if (!_open || millis() < _readyAt)
+        {
+            return 0;
+        }
+        size_t end = _response.length() + _bodyLength;
+        if (bytesPerSecond > 0)
+        {
+            size_t arrived = (uint64_t)(millis() - _readyAt) * bytesPerSecond / 1000;
+            end = arrived < end ? arrived : end;
+        }
+        return end > _position ? end - _position : 0;
+    }
+    int read()
+    {
+        uint8_t c;
+        return read(&c, 1) == 1 ? c : -1;
+    }
+    int read(uint8_t *buf, size_t size)
+    {
+        size_t n = 0;
+        while (n < size && available() > 0)
+        {
+            buf[n++] = _byteAt(_position++);
+        }
+        bytesSent += n;
+        return n > 0 ? n : -1;
+    }
+    int peek() { return available() > 0 ? _byteAt(_position) : -1; }
+    void flush() {}
+    void stop() { _open = false; }
+    uint8_t connected() { return _open && (_position < _response.length() + _bodyLength || !_closeAfterBody); }
+    operator bool() { return connected(); }
+
+private:
+    int _files;
+    const char *_paths[MOCK_MAX_FILES];
+    const uint8_t *_data[MOCK_MAX_FILES];
+    size_t _sizes[MOCK_MAX_FILES];
+    int _fileRequests[MOCK_MAX_FILES];
+    String _manifest;
+
+    int _bodies;
+    bool _open;
+    bool _closeAfterBody;
+    unsigned long _readyAt;
+    String _request;
+    String _response;
+    const uint8_t *_body;
+    size_t _bodyLength;
+    size_t _position;
+
+    uint8_t _byteAt(size_t position)
+    {
+        return position < _response.length() ? _response[position] : _body[position - _response.length()];
+    }
+
+    void _respond()
+    {
+        requests++;
+        _readyAt = millis() + latencyMs;
+        bool head = _request.startsWith("HEAD ");
+        int pathStart = _request.indexOf(' ') + 1;
+        String path = _request.substring(pathStart, _request.indexOf(' ', pathStart));
+
+        const uint8_t *file = (const uint8_t *)_manifest.c_str();
+        size_t size = _manifest.length();
+        const char *type = manifestType;
+        bool image = false;
+        for (int i = 0; i < _files; i++)
+        {
+            if (path == _paths[i])
+            {
+                file = _data[i];
+                size = _sizes[i];
+                type = "application/octet-stream";
+                image = true;
+                _fileRequests[i]++;
+            }
+        }
+
+        if (!image && manifestETag != NULL && _request.indexOf("If-None-Match: " + String(manifestETag)) >= 0)
+        {
+            notModified++;
+            _response = "HTTP/1.1 304 Not Modified\r\nETag: " + String(manifestETag) + "\r\n\r\n";
+            _bodyLength = 0;
+            _position = 0;
+            return;
+        }
+
+        size_t first = 0;
+        size_t last = size - 1;
+        int range = acceptRanges ? _request.indexOf("Range: bytes=") : -1;
+        if (range >= 0)
+        {
+            rangeRequests++;
+            unsigned int rangeFirst = 0, rangeLast = last;
+            sscanf(_request.c_str() + range, "Range: bytes=%u-%u", &rangeFirst, &rangeLast);
+            first = rangeFirst;
+            last = rangeLast < size ? rangeLast : size - 1;
+            if (rangeAnswers200)
+            {
+                range = -1;
+                first = 0;
+                last = size - 1;
+            }
+            else if (wrongRanges > 0 && first < last)
+            {
+                wrongRanges--;
+                first++;
+            }
+        }
+
+        _response = range >= 0 ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+        _response += "Content-Type: " + String(type) + "\r\n";
+        _response += "Content-Length: " + String(last - first + 1) + "\r\n";
+        if (acceptRanges)
+        {
+            _response += "Accept-Ranges: bytes\r\n";
+        }
+        if (!image && manifestETag != NULL)
+        {
+            _response += "ETag: " + String(manifestETag) + "\r\n";
+        }
+        if (range >= 0)
+        {
+            _response += "Content-Range: bytes " + String(first) + "-" + String(last) + "/" + String(size) + "\r\n";
+        }
+        _response += "\r\n";
+        _body = file + first;
+        _bodyLength = head ? 0 : last - first + 1;
+        _position = 0;
+
+        if (image && !head)
+        {
+            _bodies++;
+            if (truncateBodies > 0 || (truncateEvery > 0 && _bodies % truncateEvery == 0))
+            {
+                truncateBodies = truncateBodies > 0 ? truncateBodies - 1 : 0;
+                _bodyLength /= 2;
+                _closeAfterBody = true;
+            }
+        }
+    }
+};
+
+// Keeps the image in RAM instead of flashing it
+class MemorySink : public esp32FOTAGSMSink
+{
+public:
+    uint8_t data[MOCK_IMAGE_SIZE];
+    size_t size;
+    bool ended;
+
+    bool begin(size_t imageSize)
+    {
+        size = 0;
+        ended = false;
+        return true;
+    }
+    size_t write(uint8_t *bytes, size_t length)
+    {
+        if (size + length > sizeof(data))
+        {
+            return 0;
+        }
+        memcpy(data + size, bytes, length);
+        size += length;
+        return length;
+    }
+    bool end()
+    {
+        ended = true;
+        return true;
+    }
+    void abort() { size = 0; }
+};
+
+#endif
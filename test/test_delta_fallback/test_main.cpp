@@ -0,0 +1,85 @@
+/*
+   esp32 firmware OTA
+   Purpose: A patch that does not apply falls back to the full image, with the
+            chunks written in line (pipeline depth 1) and by the writer task
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include "esp32fotagsm.h"
+#include "../mock/esp32fotagsm_mock.h"
+
+#define IMAGE_SIZE (3000)
+#define PATCH_SIZE (29)
+
+static uint8_t image[IMAGE_SIZE];
+// "FDP1", source size, source MD5, target size, end record: a patch for
+// firmware that is not running
+static uint8_t patch[PATCH_SIZE] = {'F', 'D', 'P', '1', 0x00, 0x10, 0x00, 0x00};
+
+static const char manifest[] =
+    "{\"type\": \"test\", \"version\": 2, \"host\": \"fota.test\", \"port\": 80,"
+    " \"bin\": \"/fw.bin\", \"size\": 3000, \"delta\": {\"from\": 1, \"bin\": \"/fw.patch\"}}";
+
+static MockServer server;
+static MemorySink sink;
+
+static void runUpdate(uint8_t pipelineDepth)
+{
+    server.reset();
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    fota.checkHOST = "fota.test";
+    fota.checkPORT = 80;
+    fota.checkRESOURCE = "/fota.json";
+    fota.setSink(&sink);
+    fota.setPipelineDepth(pipelineDepth);
+    fota.setRetryPolicy(2, 10, 10);
+
+    TEST_ASSERT_TRUE(fota.execHTTPcheck());
+    TEST_ASSERT_TRUE(fota.startOTA());
+    unsigned long start = millis();
+    while (fota.isOTARunning() && millis() - start < 60000)
+    {
+        delay(10);
+    }
+
+    TEST_ASSERT_EQUAL(esp32FOTAGSM::OTA_DONE, fota.getState());
+    // the patch is given up after its first chunk, not requested again
+    TEST_ASSERT_EQUAL(2, server.requestsFor("/fw.patch"));
+    TEST_ASSERT_TRUE(server.requestsFor("/fw.bin") >= 2);
+    TEST_ASSERT_TRUE(sink.ended);
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, sink.size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(image, sink.data, IMAGE_SIZE);
+}
+
+static void test_fallback_in_line()
+{
+    runUpdate(1);
+}
+
+static void test_fallback_pipelined()
+{
+    runUpdate(2);
+}
+
+void setup()
+{
+    delay(2000);
+    for (size_t i = 0; i < IMAGE_SIZE; i++)
+    {
+        image[i] = i * 7;
+    }
+    patch[PATCH_SIZE - 1] = 'E';
+    server.setManifest(manifest);
+    server.addFile("/fw.bin", image, IMAGE_SIZE);
+    server.addFile("/fw.patch", patch, PATCH_SIZE);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_fallback_in_line);
+    RUN_TEST(test_fallback_pipelined);
+    UNITY_END();
+}
+
+void loop()
+{
+}
@@ -0,0 +1,136 @@
+/*
+   esp32 firmware OTA
+   Purpose: gzip streams split at any byte, including writes that end exactly
+            at the trailer, decompress and pass the trailer size check
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include "esp32fotagsm_inflate.h"
+
+#define IMAGE_SIZE (5290)
+
+// gzip -9 of 200 lines "line <n> of the test image\n", as Python's gzip.compress(data, 9, mtime=0)
+static const uint8_t compressed[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x7d, 0xd8, 0x3d, 0xae, 0xd5, 0x30,
+    0x14, 0x85, 0xd1, 0x9e, 0x51, 0x64, 0x08, 0xde, 0xfe, 0xf7, 0x70, 0x28, 0x2e, 0xf0, 0xa4, 0x07,
+    0x14, 0xdc, 0xf9, 0x0b, 0xd1, 0xb3, 0x5c, 0x9f, 0xea, 0x7c, 0x51, 0x92, 0x65, 0x7f, 0x7e, 0xfc,
+    0x7a, 0x3d, 0xe5, 0xf9, 0xfd, 0xed, 0x79, 0xff, 0x78, 0x3d, 0xef, 0xd7, 0x9f, 0xf7, 0xf3, 0xf1,
+    0xf3, 0xeb, 0xf7, 0xd7, 0x97, 0xcf, 0x7f, 0x83, 0x68, 0x50, 0x35, 0x68, 0x1a, 0x74, 0x0d, 0x86,
+    0x06, 0x53, 0x83, 0xa5, 0xc1, 0xd6, 0xe0, 0x70, 0x41, 0xaf, 0xce, 0xdd, 0xc3, 0xe5, 0xc3, 0xed,
+    0xc3, 0xf5, 0xc3, 0xfd, 0xc3, 0x00, 0x61, 0x81, 0x30, 0x41, 0xd8, 0xa0, 0xb2, 0x41, 0xf5, 0xf3,
+    0x67, 0x83, 0xca, 0x06, 0x95, 0x0d, 0x2a, 0x1b, 0x54, 0x36, 0xa8, 0x6c, 0x50, 0xd9, 0xa0, 0xb2,
+    0x41, 0x63, 0x83, 0xc6, 0x06, 0xcd, 0x2f, 0x01, 0x1b, 0x34, 0x36, 0x68, 0x6c, 0xd0, 0xd8, 0xa0,
+    0xb1, 0x41, 0x63, 0x83, 0xc6, 0x06, 0x9d, 0x0d, 0x3a, 0x1b, 0x74, 0x36, 0xe8, 0xfe, 0x12, 0xb0,
+    0x41, 0x67, 0x83, 0xce, 0x06, 0x9d, 0x0d, 0x3a, 0x1b, 0x74, 0x36, 0x18, 0x6c, 0x30, 0xd8, 0x60,
+    0xb0, 0xc1, 0x60, 0x83, 0xe1, 0xcf, 0x21, 0x1b, 0x0c, 0x36, 0x18, 0x6c, 0x30, 0xd8, 0x60, 0xb0,
+    0xc1, 0x64, 0x83, 0xc9, 0x06, 0x93, 0x0d, 0x26, 0x1b, 0x4c, 0x36, 0x98, 0xfe, 0x27, 0xb0, 0xc1,
+    0x64, 0x83, 0xc9, 0x06, 0x93, 0x0d, 0x16, 0x1b, 0x2c, 0x36, 0x58, 0x6c, 0xb0, 0xd8, 0x60, 0xb1,
+    0xc1, 0x62, 0x83, 0xe5, 0x1f, 0x23, 0x1b, 0x2c, 0x36, 0x58, 0x6c, 0xb0, 0xd9, 0x60, 0xb3, 0xc1,
+    0x66, 0x83, 0xcd, 0x06, 0x9b, 0x0d, 0x36, 0x1b, 0x6c, 0x36, 0xd8, 0xd6, 0x01, 0x1b, 0x6c, 0x36,
+    0x38, 0x6c, 0x70, 0xd8, 0xe0, 0xb0, 0xc1, 0x61, 0x83, 0xc3, 0x06, 0x87, 0x0d, 0x0e, 0x1b, 0x1c,
+    0x36, 0x38, 0x26, 0xd2, 0xc5, 0x48, 0x46, 0x52, 0xb1, 0x92, 0x8a, 0x99, 0x54, 0xec, 0xa4, 0x62,
+    0x28, 0x15, 0x4b, 0xa9, 0x98, 0x4a, 0xc5, 0x56, 0x2a, 0xc6, 0x52, 0x71, 0x8d, 0x1b, 0x19, 0x5d,
+    0xe3, 0x82, 0xc6, 0x8b, 0x1a, 0x2f, 0x6c, 0xbc, 0xb8, 0xf1, 0x02, 0xc7, 0x8b, 0x1c, 0x2f, 0x74,
+    0xb4, 0x1d, 0x63, 0x3c, 0xa6, 0x5e, 0x04, 0xed, 0x1a, 0xf6, 0x63, 0x0c, 0xc8, 0x58, 0x90, 0x31,
+    0x21, 0x63, 0x43, 0xc6, 0x88, 0x8c, 0x15, 0x19, 0x33, 0x32, 0x76, 0x64, 0xda, 0xe5, 0x40, 0xe1,
+    0x1a, 0xa6, 0x64, 0x6c, 0xc9, 0x18, 0x93, 0xb1, 0x26, 0x63, 0x4e, 0xc6, 0x9e, 0x8c, 0x41, 0x19,
+    0x8b, 0x32, 0x26, 0x65, 0xfa, 0xe5, 0x7c, 0xe5, 0x1a, 0x56, 0x65, 0xcc, 0xca, 0xd8, 0x95, 0x31,
+    0x2c, 0x63, 0x59, 0xc6, 0xb4, 0x8c, 0x6d, 0x19, 0xe3, 0x32, 0xd6, 0x65, 0xc6, 0xe5, 0xb8, 0xe9,
+    0x1a, 0x06, 0x66, 0x2c, 0xcc, 0x98, 0x98, 0xb1, 0x31, 0x63, 0x64, 0xc6, 0xca, 0x8c, 0x99, 0x19,
+    0x3b, 0x33, 0x86, 0x66, 0xe6, 0xe5, 0xf4, 0xed, 0x1a, 0xb6, 0x66, 0x8c, 0xcd, 0x58, 0x9b, 0x31,
+    0x37, 0x63, 0x6f, 0xc6, 0xe0, 0x8c, 0xc5, 0x19, 0x93, 0x33, 0x36, 0x67, 0xd6, 0xe5, 0x32, 0xc2,
+    0x35, 0xcc, 0xce, 0xd8, 0x9d, 0x31, 0x3c, 0x63, 0x79, 0xc6, 0xf4, 0x8c, 0xed, 0x19, 0xe3, 0x33,
+    0xd6, 0x67, 0xcc, 0xcf, 0xec, 0xcb, 0xdd, 0x8c, 0x6b, 0x58, 0xa0, 0x31, 0x41, 0x63, 0x83, 0xc6,
+    0x08, 0x8d, 0x15, 0x1a, 0x33, 0x34, 0x76, 0x68, 0x0c, 0xd1, 0x58, 0xa2, 0x39, 0x97, 0xab, 0xaa,
+    0xff, 0xd5, 0xf8, 0x0b, 0x9c, 0x82, 0x73, 0x3b, 0xaa, 0x14, 0x00, 0x00,
+};
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t output[IMAGE_SIZE];
+static size_t outputSize;
+
+static size_t collect(uint8_t *data, size_t length)
+{
+    if (outputSize + length > sizeof(output))
+    {
+        return 0;
+    }
+    memcpy(output + outputSize, data, length);
+    outputSize += length;
+    return length;
+}
+
+// Decompress with writes of at most step bytes, the first one ending at split
+static void inflate(size_t split, size_t step)
+{
+    esp32FOTAGSMInflater inflater;
+    outputSize = 0;
+
+    TEST_ASSERT_TRUE(inflater.begin(esp32FOTAGSMInflater::FORMAT_GZIP, collect, false));
+    size_t offset = 0;
+    while (offset < sizeof(compressed))
+    {
+        size_t length = offset == 0 && split > 0 ? split : step;
+        if (length > sizeof(compressed) - offset)
+        {
+            length = sizeof(compressed) - offset;
+        }
+        TEST_ASSERT_TRUE(inflater.write(compressed + offset, length));
+        offset += length;
+    }
+    TEST_ASSERT_TRUE(inflater.end());
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, outputSize);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(image, output, IMAGE_SIZE);
+    inflater.release();
+}
+
+// The whole stream in one write, it ends exactly with the trailer
+static void test_single_write()
+{
+    inflate(0, sizeof(compressed));
+}
+
+// The first write ends exactly where the trailer starts
+static void test_write_ends_at_trailer()
+{
+    inflate(sizeof(compressed) - 8, sizeof(compressed));
+}
+
+// Every split inside and around the trailer
+static void test_split_near_trailer()
+{
+    for (size_t split = sizeof(compressed) - 16; split < sizeof(compressed); split++)
+    {
+        inflate(split, sizeof(compressed));
+    }
+}
+
+static void test_byte_by_byte()
+{
+    inflate(0, 1);
+}
+
+void setup()
+{
+    delay(2000);
+    size_t length = 0;
+    char line[32];
+    for (int i = 0; length < IMAGE_SIZE; i++)
+    {
+        int n = snprintf(line, sizeof(line), "line %d of the test image\n", i);
+        memcpy(image + length, line, n);
+        length += n;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_single_write);
+    RUN_TEST(test_write_ends_at_trailer);
+    RUN_TEST(test_split_near_trailer);
+    RUN_TEST(test_byte_by_byte);
+    UNITY_END();
+}
+
+void loop()
+{
+}
@@ -0,0 +1,216 @@
+/*
+   esp32 firmware OTA
+   Purpose: How the client handles the answers of the server: Range requests
+            answered with 200, wrong Content-Range, short and truncated bodies,
+            304 and Content-Type parameters, manifests with several entries and
+            the streaming download
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include "esp32fotagsm.h"
+#include "../mock/esp32fotagsm_mock.h"
+
+#define IMAGE_SIZE (3000)
+
+static uint8_t image[IMAGE_SIZE];
+
+static const char manifest[] =
+    "{\"type\": \"test\", \"version\": 2, \"host\": \"fota.test\", \"port\": 80,"
+    " \"bin\": \"/fw.bin\", \"size\": 3000}";
+
+// Only the version 2 entry applies to version 1 of "test"
+static const char manifestEntries[] =
+    "[{\"type\": \"other\", \"version\": 9, \"host\": \"fota.test\", \"bin\": \"/other.bin\"},"
+    " {\"type\": \"test\", \"version\": 3, \"maxVersion\": 0, \"host\": \"fota.test\", \"bin\": \"/other.bin\"},"
+    " {\"type\": \"test\", \"version\": 4, \"rollout\": 0, \"host\": \"fota.test\", \"bin\": \"/other.bin\"},"
+    " {\"type\": \"test\", \"version\": 2, \"host\": \"fota.test\", \"port\": 80, \"bin\": \"/fw.bin\", \"size\": 3000},"
+    " {\"type\": \"test\", \"version\": 2, \"host\": \"fota.test\", \"bin\": \"/other.bin\"}]";
+
+static MockServer server;
+static MemorySink sink;
+
+static void setUpClient(esp32FOTAGSM &fota)
+{
+    fota.checkHOST = "fota.test";
+    fota.checkPORT = 80;
+    fota.checkRESOURCE = "/fota.json";
+    fota.setSink(&sink);
+    fota.setRetryPolicy(2, 10, 10);
+    // three chunks of the image
+    fota.setChunkBuffer(1024, false);
+}
+
+// Check the manifest, run the update and wait until it ends
+static esp32FOTAGSM::OTAState runUpdate(esp32FOTAGSM &fota)
+{
+    TEST_ASSERT_TRUE(fota.execHTTPcheck());
+    TEST_ASSERT_TRUE(fota.startOTA());
+    unsigned long start = millis();
+    while (fota.isOTARunning() && millis() - start < 60000)
+    {
+        delay(10);
+    }
+    return fota.getState();
+}
+
+// The update ended with the image in the sink
+static void assertInstalled(esp32FOTAGSM::OTAState state)
+{
+    TEST_ASSERT_EQUAL(esp32FOTAGSM::OTA_DONE, state);
+    TEST_ASSERT_TRUE(sink.ended);
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, sink.size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(image, sink.data, IMAGE_SIZE);
+}
+
+void setUp()
+{
+    server.reset();
+    server.setManifest(manifest);
+    sink.ended = false;
+}
+
+// Ranges were announced by the HEAD request, a 200 to a Range request is not
+// downloaded again and again
+static void test_range_answered_with_200()
+{
+    server.rangeAnswers200 = true;
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    TEST_ASSERT_EQUAL(esp32FOTAGSM::OTA_FAILED, runUpdate(fota));
+    TEST_ASSERT_EQUAL(1, server.rangeRequests);
+    TEST_ASSERT_FALSE(sink.ended);
+}
+
+// Without the HEAD request, a 200 to the first Range request carries the image
+static void test_first_range_answered_with_200()
+{
+    server.rangeAnswers200 = true;
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+    fota.setSkipHeadRequest(true);
+
+    assertInstalled(runUpdate(fota));
+    TEST_ASSERT_EQUAL(1, server.requestsFor("/fw.bin"));
+}
+
+// Bytes other than the ones asked for are dropped and the chunk asked again
+static void test_wrong_content_range()
+{
+    server.wrongRanges = 1;
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    assertInstalled(runUpdate(fota));
+    TEST_ASSERT_EQUAL(1, fota.getMetrics().retries);
+}
+
+// A chunk that ends early continues from the first missing byte
+static void test_short_body()
+{
+    server.truncateBodies = 1;
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    assertInstalled(runUpdate(fota));
+    TEST_ASSERT_EQUAL(1, fota.getMetrics().shortReads);
+    TEST_ASSERT_TRUE(server.connects >= 2);
+}
+
+// A body that ends early in a single GET is never handed to the sink as done
+static void test_truncated_full_download()
+{
+    server.acceptRanges = false;
+    server.truncateBodies = 100;
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    TEST_ASSERT_EQUAL(esp32FOTAGSM::OTA_FAILED, runUpdate(fota));
+    TEST_ASSERT_FALSE(sink.ended);
+}
+
+// An unchanged manifest keeps the result of the last check
+static void test_manifest_not_modified()
+{
+    server.manifestETag = "\"v2\"";
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    TEST_ASSERT_TRUE(fota.execHTTPcheck());
+    TEST_ASSERT_EQUAL(0, server.notModified);
+    TEST_ASSERT_TRUE(fota.execHTTPcheck());
+    TEST_ASSERT_EQUAL(1, server.notModified);
+
+    // without an update the validators survive in NVS. A manifest without
+    // them first clears what an earlier run left there.
+    server.manifestETag = NULL;
+    esp32FOTAGSM current(server, "test", 2, nullptr, NULL);
+    setUpClient(current);
+    TEST_ASSERT_FALSE(current.execHTTPcheck());
+    server.manifestETag = "\"v2\"";
+    TEST_ASSERT_FALSE(current.execHTTPcheck());
+    esp32FOTAGSM rebooted(server, "test", 2, nullptr, NULL);
+    setUpClient(rebooted);
+    TEST_ASSERT_FALSE(rebooted.execHTTPcheck());
+    TEST_ASSERT_EQUAL(2, server.notModified);
+}
+
+// The media type counts, not its case or its parameters
+static void test_manifest_type_with_parameters()
+{
+    server.manifestType = "Application/JSON; charset=utf-8";
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    TEST_ASSERT_TRUE(fota.execHTTPcheck());
+}
+
+// The newest entry for this type, version and device wins
+static void test_manifest_entries()
+{
+    server.setManifest(manifestEntries);
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+
+    assertInstalled(runUpdate(fota));
+    TEST_ASSERT_EQUAL(0, server.requestsFor("/other.bin"));
+}
+
+// One Range request for the whole image, read in chunks
+static void test_streaming_download()
+{
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    setUpClient(fota);
+    fota.setStreamingDownload(true);
+
+    assertInstalled(runUpdate(fota));
+    TEST_ASSERT_EQUAL(1, server.rangeRequests);
+}
+
+void setup()
+{
+    delay(2000);
+    for (size_t i = 0; i < IMAGE_SIZE; i++)
+    {
+        image[i] = i * 7;
+    }
+    server.addFile("/fw.bin", image, IMAGE_SIZE);
+    server.addFile("/other.bin", image, IMAGE_SIZE);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_range_answered_with_200);
+    RUN_TEST(test_first_range_answered_with_200);
+    RUN_TEST(test_wrong_content_range);
+    RUN_TEST(test_short_body);
+    RUN_TEST(test_truncated_full_download);
+    RUN_TEST(test_manifest_not_modified);
+    RUN_TEST(test_manifest_type_with_parameters);
+    RUN_TEST(test_manifest_entries);
+    RUN_TEST(test_streaming_download);
+    UNITY_END();
+}
+
+void loop()
+{
+}
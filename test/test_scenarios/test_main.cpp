@@ -0,0 +1,123 @@
+/*
+   esp32 firmware OTA
+   Purpose: Download the same image over a simulated GPRS link with different
+            chunk sizes, keep-alive and retry policies and print the metrics of
+            each, so a change of the downloader can be compared on the bench
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include "esp32fotagsm.h"
+#include "../mock/esp32fotagsm_mock.h"
+
+#define IMAGE_SIZE (8192)
+
+// a slow GPRS link: TCP setup, round trip and about 32 kbit/s
+#define LINK_CONNECT_MS (800)
+#define LINK_LATENCY_MS (400)
+#define LINK_BYTES_PER_SECOND (4000)
+
+struct Scenario
+{
+    const char *name;
+    size_t chunkSize;
+    // 0 for a fixed chunk size
+    size_t minChunkSize;
+    bool keepAlive;
+    unsigned long retryDelayMs;
+    // faults of the server, see MockServer
+    int wrongRanges;
+    int truncateEvery;
+};
+
+static const Scenario scenarios[] = {
+    {"1k chunks, keep-alive", 1024, 0, true, 1000, 0, 0},
+    {"4k chunks, keep-alive", 4096, 0, true, 1000, 0, 0},
+    {"8k chunks, keep-alive", 8192, 0, true, 1000, 0, 0},
+    {"1k chunks, close", 1024, 0, false, 1000, 0, 0},
+    {"4k chunks, close", 4096, 0, false, 1000, 0, 0},
+    {"4k chunks, 3 bad ranges, retry 100 ms", 4096, 0, true, 100, 3, 0},
+    {"4k chunks, 3 bad ranges, retry 2 s", 4096, 0, true, 2000, 3, 0},
+    {"4k chunks, every 3rd cut", 4096, 0, true, 1000, 0, 3},
+    {"512-4k adaptive, every 3rd cut", 4096, 512, true, 1000, 0, 3},
+};
+
+static uint8_t image[IMAGE_SIZE];
+
+static const char manifest[] =
+    "{\"type\": \"test\", \"version\": 2, \"host\": \"fota.test\", \"port\": 80,"
+    " \"bin\": \"/fw.bin\", \"size\": 8192}";
+
+static MockServer server;
+static MemorySink sink;
+
+static void runScenario(const Scenario &scenario, esp32FOTAGSM::OTAMetrics &metrics)
+{
+    server.reset();
+    server.connectMs = LINK_CONNECT_MS;
+    server.latencyMs = LINK_LATENCY_MS;
+    server.bytesPerSecond = LINK_BYTES_PER_SECOND;
+    server.wrongRanges = scenario.wrongRanges;
+    server.truncateEvery = scenario.truncateEvery;
+
+    esp32FOTAGSM fota(server, "test", 1, nullptr, NULL);
+    fota.checkHOST = "fota.test";
+    fota.checkPORT = 80;
+    fota.checkRESOURCE = "/fota.json";
+    fota.setSink(&sink);
+    fota.setChunkBuffer(scenario.chunkSize, false);
+    if (scenario.minChunkSize > 0)
+    {
+        fota.setAdaptiveChunkSize(scenario.minChunkSize, scenario.chunkSize);
+    }
+    fota.setKeepAlive(scenario.keepAlive);
+    fota.setRetryPolicy(10, scenario.retryDelayMs, 8 * scenario.retryDelayMs);
+
+    TEST_ASSERT_TRUE(fota.execHTTPcheck());
+    TEST_ASSERT_TRUE(fota.startOTA());
+    unsigned long start = millis();
+    while (fota.isOTARunning() && millis() - start < 300000)
+    {
+        delay(10);
+    }
+
+    TEST_ASSERT_EQUAL_MESSAGE(esp32FOTAGSM::OTA_DONE, fota.getState(), scenario.name);
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, sink.size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(image, sink.data, IMAGE_SIZE);
+    metrics = fota.getMetrics();
+}
+
+// One line per scenario, the same order as the table
+static void test_scenarios()
+{
+    Serial.printf("%-40s %8s %8s %8s %8s %8s %8s %8s\n", "scenario", "total ms", "requests", "connects",
+                  "B/s", "retries", "short", "sent");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        esp32FOTAGSM::OTAMetrics metrics;
+        runScenario(scenarios[i], metrics);
+        Serial.printf("%-40s %8u %8u %8u %8u %8u %8u %8u\n", scenarios[i].name, (unsigned)metrics.totalMs,
+                      (unsigned)metrics.requests, (unsigned)metrics.connects, (unsigned)metrics.bytesPerSecond,
+                      (unsigned)metrics.retries, (unsigned)metrics.shortReads, (unsigned)server.bytesSent);
+    }
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    delay(2000);
+    for (size_t i = 0; i < IMAGE_SIZE; i++)
+    {
+        image[i] = i * 7;
+    }
+    server.setManifest(manifest);
+    server.addFile("/fw.bin", image, IMAGE_SIZE);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_scenarios);
+    UNITY_END();
+}
+
+void loop()
+{
+}
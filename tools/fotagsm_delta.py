@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""Create a patch for a delta update of esp32FOTAGSM.
+
+    python3 fotagsm_delta.py old.bin new.bin firmware_1_2.patch [--gzip]
+
+old.bin must be the exact image running on the devices. The patch format is
+described in src/esp32fotagsm_delta.h.
+"""
+
+import argparse
+import gzip
+import hashlib
+import struct
+
+MAGIC = b"FDP1"
+KEY = 8            # bytes hashed to find a match
+STEP = 4           # the source is indexed every STEP bytes
+MIN_MATCH = 24     # shorter matches are inserted
+CANDIDATES = 8     # source positions tried per key
+GIVE_UP = 128      # stop extending this many bytes after the best score
+
+
+def build_index(old):
+    index = {}
+    for pos in range(0, len(old) - KEY + 1, STEP):
+        entries = index.setdefault(old[pos:pos + KEY], [])
+        if len(entries) < CANDIDATES:
+            entries.append(pos)
+    return index
+
+
+def extend(old, new, src, dst):
+    """Length of the region new[dst:] follows old[src:] with few differences,
+    scored like bsdiff: every equal byte counts +1 and every different one -1."""
+    best_len = 0
+    best_score = 0
+    score = 0
+    i = 0
+    while dst + i < len(new) and src + i < len(old):
+        score += 1 if new[dst + i] == old[src + i] else -1
+        i += 1
+        if score > best_score:
+            best_score = score
+            best_len = i
+        elif i - best_len > GIVE_UP:
+            break
+    return best_len
+
+
+def diff(old, new):
+    index = build_index(old)
+    records = []
+    literal = 0
+    pos = 0
+    last_src = 0
+
+    while pos < len(new):
+        best_len = 0
+        best_src = 0
+        candidates = index.get(new[pos:pos + KEY], [])
+        # the position right after the previous match is tried first, it is
+        # where shifted code continues
+        for src in [last_src] + candidates:
+            length = extend(old, new, src, pos)
+            if length > best_len:
+                best_len = length
+                best_src = src
+
+        if best_len < MIN_MATCH:
+            pos += 1
+            continue
+
+        if literal < pos:
+            records.append(("I", new[literal:pos]))
+        records.append(("A", best_src, new[pos:pos + best_len]))
+        pos += best_len
+        literal = pos
+        last_src = best_src + best_len
+
+    if literal < len(new):
+        records.append(("I", new[literal:]))
+    return records
+
+
+def encode(old, new, records):
+    out = bytearray(MAGIC)
+    out += struct.pack("<I", len(old))
+    out += hashlib.md5(old).digest()
+    out += struct.pack("<I", len(new))
+
+    for record in records:
+        if record[0] == "I":
+            out += b"I" + struct.pack("<I", len(record[1])) + record[1]
+            continue
+
+        _, src, data = record
+        delta = bytes((b - a) & 0xff for a, b in zip(old[src:src + len(data)], data))
+        if any(delta):
+            out += b"A" + struct.pack("<II", src, len(data)) + delta
+        else:
+            out += b"C" + struct.pack("<II", src, len(data))
+    out += b"E"
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("old", help="image running on the devices")
+    parser.add_argument("new", help="image to update to")
+    parser.add_argument("patch", help="patch file to write")
+    parser.add_argument("--gzip", action="store_true", help="compress the patch, set \"compression\": \"gzip\" in the manifest")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    patch = encode(old, new, diff(old, new))
+    if args.gzip:
+        patch = gzip.compress(patch, 9)
+
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+
+    print("%s: %d bytes for a %d byte image, md5 %s" % (args.patch, len(patch), len(new), hashlib.md5(new).hexdigest()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""Serve manifests and images to esp32FOTAGSM over a simulated GPRS link.
+
+    python3 fotagsm_server.py www/ --port 8080 --bandwidth 6000 --latency 600 \\
+        --jitter 300 --short-read 0.02 --disconnect 0.01
+
+Files are served from the given directory with HEAD, Range requests,
+ETag / If-None-Match and Last-Modified / If-Modified-Since like a typical
+web server, manifests (.json) as application/json and everything else as
+application/octet-stream. Every response is delayed by
+the link latency (plus random jitter) and sent no faster than the bandwidth.
+With --short-read a response body ends early and the connection is closed,
+with --disconnect the connection is closed before the response. --close
+makes the server close every connection like an HTTP/1.0 server.
+
+For every download the server prints the time from the first request of
+the client to the last byte of the image, the requests and connections it
+took and the bytes on the wire including headers. Together with the
+device side metrics (getMetrics()) this shows what a change to the
+downloader costs over a slow link. --seed repeats the same faults.
+"""
+
+import argparse
+import email.utils
+import hashlib
+import http.server
+import mimetypes
+import os
+import random
+import re
+import socketserver
+import threading
+import time
+
+SLICE = 512        # bytes sent between bandwidth pauses
+IDLE_RESET = 30.0  # seconds without requests before a client starts a new run
+
+
+class Run:
+    """Counters of one client from its first request to the end of an image."""
+
+    def __init__(self):
+        self.start = time.monotonic()
+        self.requests = 0
+        self.connections = 0
+        self.wire_bytes = 0
+        self.body_bytes = 0
+        self.faults = 0
+        self.last = self.start
+        self.served = {}   # path -> set of (start, end) byte ranges sent
+
+
+class Link:
+    def __init__(self, args):
+        self.args = args
+        self.random = random.Random(args.seed)
+        self.lock = threading.Lock()
+        self.runs = {}
+
+    def chance(self, probability):
+        with self.lock:
+            return self.random.random() < probability
+
+    def cut(self, length):
+        with self.lock:
+            return self.random.randrange(length)
+
+    def delay(self):
+        with self.lock:
+            jitter = self.random.uniform(-self.args.jitter, self.args.jitter)
+        time.sleep(max(0.0, self.args.latency + jitter) / 1000.0)
+
+    def run(self, client):
+        with self.lock:
+            run = self.runs.get(client)
+            now = time.monotonic()
+            if run is None or now - run.last > IDLE_RESET:
+                run = Run()
+                self.runs[client] = run
+            run.last = now
+            return run
+
+    def finish(self, client, path, size):
+        with self.lock:
+            run = self.runs.pop(client, None)
+        if run is None:
+            return
+        elapsed = time.monotonic() - run.start
+        overhead = 100.0 * (run.wire_bytes - size) / size if size else 0.0
+        print("%s %s: %d bytes in %.1f s (%.0f B/s), %d requests, %d connections, %d faults, "
+              "%d bytes on the wire (%.1f%% overhead)" %
+              (client, path, size, elapsed, size / elapsed if elapsed else 0, run.requests,
+               run.connections, run.faults, run.wire_bytes, overhead), flush=True)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        super().setup()
+        self.run = self.server.link.run(self.client_address[0])
+        self.run.connections += 1
+
+    def log_message(self, format, *args):
+        if self.server.link.args.verbose:
+            super().log_message(format, *args)
+
+    def send(self, data):
+        """Send at the link bandwidth, False if the connection is gone."""
+        bandwidth = self.server.link.args.bandwidth
+        for offset in range(0, len(data), SLICE):
+            piece = data[offset:offset + SLICE]
+            try:
+                self.wfile.write(piece)
+                self.wfile.flush()
+            except OSError:
+                return False
+            self.run.wire_bytes += len(piece)
+            if bandwidth > 0:
+                time.sleep(len(piece) / bandwidth)
+        return True
+
+    def respond(self, status, headers, body=b""):
+        link = self.server.link
+        lines = ["HTTP/1.1 %d %s" % (status, self.responses.get(status, ("",))[0])]
+        lines += ["%s: %s" % header for header in headers]
+        head = ("\r\n".join(lines) + "\r\n\r\n").encode()
+
+        link.delay()
+        if not self.send(head):
+            return False
+
+        if body and link.chance(link.args.short_read):
+            self.run.faults += 1
+            cut = link.cut(len(body))
+            self.log_message("short read after %d of %d bytes", cut, len(body))
+            self.send(body[:cut])
+            self.close_connection = True
+            return False
+
+        if not self.send(body):
+            return False
+        self.run.body_bytes += len(body)
+        return True
+
+    def handle_one_request(self):
+        try:
+            super().handle_one_request()
+        except ConnectionError:
+            self.close_connection = True
+
+    def do_HEAD(self):
+        self.serve(False)
+
+    def do_GET(self):
+        self.serve(True)
+
+    def serve(self, with_body):
+        link = self.server.link
+        self.run.requests += 1
+        self.run.wire_bytes += len(self.requestline) + 2 + len(str(self.headers)) + 2
+
+        if link.chance(link.args.disconnect):
+            self.run.faults += 1
+            self.log_message("dropping the connection")
+            self.close_connection = True
+            return
+
+        keep_alive = not link.args.close and self.headers.get("Connection", "").lower() != "close"
+        connection = [("Connection", "keep-alive" if keep_alive else "close")]
+        self.close_connection = not keep_alive
+
+        path = os.path.normpath(self.path.split("?", 1)[0]).lstrip("/")
+        file = os.path.join(link.args.root, path)
+        if path.startswith("..") or not os.path.isfile(file):
+            self.respond(404, [("Content-Length", "0")] + connection)
+            return
+
+        with open(file, "rb") as f:
+            data = f.read()
+        stat = os.stat(file)
+        etag = '"%s"' % hashlib.md5(data).hexdigest()[:16]
+        headers = [("ETag", etag),
+                   ("Last-Modified", email.utils.formatdate(stat.st_mtime, usegmt=True)),
+                   ("Accept-Ranges", "bytes"),
+                   ("Content-Type", content_type(file))]
+
+        if self.headers.get("If-None-Match") == etag or not_modified_since(self.headers, stat.st_mtime):
+            self.respond(304, headers + [("Content-Length", "0")] + connection)
+            return
+
+        first, last, status = 0, len(data) - 1, 200
+        match = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+        if match:
+            first = int(match.group(1))
+            last = min(int(match.group(2)) if match.group(2) else len(data) - 1, len(data) - 1)
+            if first > last:
+                self.respond(416, [("Content-Range", "bytes */%d" % len(data)), ("Content-Length", "0")] + connection)
+                return
+            status = 206
+            headers.append(("Content-Range", "bytes %d-%d/%d" % (first, last, len(data))))
+
+        body = data[first:last + 1]
+        headers.append(("Content-Length", str(len(body))))
+        if not self.respond(status, headers + connection, body if with_body else b""):
+            return
+
+        if with_body and not path.endswith(".json"):
+            served = self.run.served.setdefault(path, [])
+            served.append((first, last))
+            if covered(served, len(data)):
+                link.finish(self.client_address[0], path, len(data))
+
+
+def content_type(path):
+    """application/json for the manifests, the device takes anything else as an image."""
+    kind, _ = mimetypes.guess_type(path)
+    return kind if kind == "application/json" else "application/octet-stream"
+
+
+def not_modified_since(headers, mtime):
+    """If-Modified-Since, which If-None-Match overrides when both are sent."""
+    if "If-None-Match" in headers or "If-Modified-Since" not in headers:
+        return False
+    try:
+        since = email.utils.parsedate_to_datetime(headers["If-Modified-Since"])
+    except (TypeError, ValueError):
+        return False
+    return int(mtime) <= since.timestamp()
+
+
+def covered(ranges, size):
+    end = 0
+    for first, last in sorted(ranges):
+        if first > end:
+            return False
+        end = max(end, last + 1)
+    return end >= size
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("root", help="directory with the manifests and images")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--bandwidth", type=float, default=6000, help="bytes per second, 0 for unlimited (default 6000, GPRS)")
+    parser.add_argument("--latency", type=float, default=600, help="ms before every response (default 600)")
+    parser.add_argument("--jitter", type=float, default=0, help="+- ms added to the latency")
+    parser.add_argument("--short-read", type=float, default=0, help="probability that a body ends early")
+    parser.add_argument("--disconnect", type=float, default=0, help="probability that a request is dropped")
+    parser.add_argument("--close", action="store_true", help="close the connection after every response")
+    parser.add_argument("--seed", type=int, help="seed for jitter and faults")
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    args = parser.parse_args()
+
+    server = Server(("", args.port), Handler)
+    server.link = Link(args)
+    print("Serving %s on port %d" % (args.root, args.port), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()